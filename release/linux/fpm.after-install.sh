@@ -1,6 +1,6 @@
 if which systemctl > /dev/null ; then
-  systemctl enable trezord.service
-  systemctl start trezord.service
+  systemctl enable trezord.socket
+  systemctl start trezord.socket
 else
   chkconfig --add trezord || update-rc.d trezord defaults
   service trezord start
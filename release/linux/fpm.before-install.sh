@@ -3,3 +3,6 @@ getent passwd trezord >/dev/null || useradd -r -g trezord -d /var -s /sbin/nolog
 touch /var/log/trezord.log
 chown trezord:trezord /var/log/trezord.log
 chmod 660 /var/log/trezord.log
+mkdir -p /var/lib/trezord
+chown trezord:trezord /var/lib/trezord
+chmod 750 /var/lib/trezord
@@ -1,6 +1,6 @@
 if which systemctl > /dev/null ; then
-  systemctl stop trezord.service
-  systemctl disable trezord.service
+  systemctl stop trezord.socket trezord.service
+  systemctl disable trezord.socket trezord.service
 else
   service trezord stop
   chkconfig --del trezord || update-rc.d -f trezord remove
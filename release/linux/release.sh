@@ -15,6 +15,7 @@ install -D -m 0755 trezord                          ./usr/bin/trezord
 install -D -m 0644 ../release/linux/trezor.rules    ./lib/udev/rules.d/51-trezor.rules
 install -D -m 0755 ../release/linux/trezord.init    ./etc/init.d/trezord
 install -D -m 0644 ../release/linux/trezord.service ./usr/lib/systemd/system/trezord.service
+install -D -m 0644 ../release/linux/trezord.socket  ./usr/lib/systemd/system/trezord.socket
 
 strip ./usr/bin/trezord
 
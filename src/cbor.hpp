@@ -0,0 +1,516 @@
+/*
+ * This file is part of the TREZOR project.
+ *
+ * Copyright (C) 2014 SatoshiLabs
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <json/json.h>
+
+#include "utils.hpp"
+
+namespace trezord
+{
+namespace cbor
+{
+
+/**
+ * Minimal CBOR (RFC 7049) support, definite lengths only
+ */
+
+// nesting of arrays, maps and tags, deeper data is rejected instead of
+// exhausting the stack
+static const int max_depth = 64;
+
+void
+check_depth(int depth)
+{
+    if (depth > max_depth) {
+        throw std::invalid_argument{"CBOR nesting is too deep"};
+    }
+}
+
+enum class major_type : std::uint8_t
+{
+    unsigned_int = 0,
+    negative_int = 1,
+    bytes = 2,
+    text = 3,
+    array = 4,
+    map = 5,
+    tag = 6,
+    simple = 7
+};
+
+struct writer
+{
+    std::vector<std::uint8_t> data;
+
+    void
+    write_uint(std::uint64_t value)
+    { write_head(major_type::unsigned_int, value); }
+
+    void
+    write_int(std::int64_t value)
+    {
+        if (value < 0) {
+            write_head(major_type::negative_int,
+                       static_cast<std::uint64_t>(-(value + 1)));
+        }
+        else {
+            write_head(major_type::unsigned_int, value);
+        }
+    }
+
+    void
+    write_bytes(std::string const &bytes)
+    {
+        write_head(major_type::bytes, bytes.size());
+        data.insert(data.end(), bytes.begin(), bytes.end());
+    }
+
+    void
+    write_text(std::string const &text)
+    {
+        write_head(major_type::text, text.size());
+        data.insert(data.end(), text.begin(), text.end());
+    }
+
+    void
+    write_array_header(std::uint64_t size)
+    { write_head(major_type::array, size); }
+
+    void
+    write_map_header(std::uint64_t size)
+    { write_head(major_type::map, size); }
+
+    void
+    write_bool(bool value)
+    { data.push_back(value ? 0xF5 : 0xF4); }
+
+    void
+    write_null()
+    { data.push_back(0xF6); }
+
+    void
+    write_double(double value)
+    {
+        std::uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        data.push_back(0xFB);
+        write_be(bits, 8);
+    }
+
+private:
+
+    void
+    write_head(major_type type, std::uint64_t value)
+    {
+        auto major = static_cast<std::uint8_t>(type) << 5;
+
+        if (value < 24) {
+            data.push_back(major | value);
+        }
+        else if (value <= 0xFF) {
+            data.push_back(major | 24);
+            write_be(value, 1);
+        }
+        else if (value <= 0xFFFF) {
+            data.push_back(major | 25);
+            write_be(value, 2);
+        }
+        else if (value <= 0xFFFFFFFF) {
+            data.push_back(major | 26);
+            write_be(value, 4);
+        }
+        else {
+            data.push_back(major | 27);
+            write_be(value, 8);
+        }
+    }
+
+    void
+    write_be(std::uint64_t value, int size)
+    {
+        for (int i = size - 1; i >= 0; i--) {
+            data.push_back((value >> (i * 8)) & 0xFF);
+        }
+    }
+};
+
+struct reader
+{
+    reader(std::uint8_t const *data, std::size_t size)
+        : begin{data},
+          end{data + size},
+          pos{data}
+    { }
+
+    bool
+    at_end() const
+    { return pos == end; }
+
+    std::size_t
+    position() const
+    { return pos - begin; }
+
+    void
+    seek(std::size_t position)
+    {
+        if (position > static_cast<std::size_t>(end - begin)) {
+            throw std::invalid_argument{"CBOR position out of range"};
+        }
+        pos = begin + position;
+    }
+
+    major_type
+    peek_type() const
+    {
+        require(1);
+        return static_cast<major_type>(*pos >> 5);
+    }
+
+    bool
+    peek_null() const
+    {
+        require(1);
+        return *pos == 0xF6;
+    }
+
+    bool
+    peek_bool() const
+    {
+        require(1);
+        return *pos == 0xF4 || *pos == 0xF5;
+    }
+
+    std::uint64_t
+    read_uint()
+    { return read_head(major_type::unsigned_int); }
+
+    std::int64_t
+    read_int()
+    {
+        static const std::uint64_t max = std::numeric_limits<std::int64_t>::max();
+
+        auto type = peek_type() == major_type::negative_int
+            ? major_type::negative_int
+            : major_type::unsigned_int;
+        auto value = read_head(type);
+        if (value > max) {
+            throw std::invalid_argument{"CBOR integer out of range"};
+        }
+        return type == major_type::negative_int
+            ? -1 - static_cast<std::int64_t>(value)
+            : static_cast<std::int64_t>(value);
+    }
+
+    std::string
+    read_bytes()
+    { return read_string(major_type::bytes); }
+
+    std::string
+    read_text()
+    { return read_string(major_type::text); }
+
+    std::uint64_t
+    read_array_header()
+    { return read_head(major_type::array); }
+
+    std::uint64_t
+    read_map_header()
+    { return read_head(major_type::map); }
+
+    bool
+    read_bool()
+    {
+        if (!peek_bool()) {
+            throw std::invalid_argument{"expecting CBOR bool"};
+        }
+        return *pos++ == 0xF5;
+    }
+
+    void
+    read_null()
+    {
+        if (!peek_null()) {
+            throw std::invalid_argument{"expecting CBOR null"};
+        }
+        pos++;
+    }
+
+    double
+    read_double()
+    {
+        switch (peek_type()) {
+        case major_type::unsigned_int:
+            return read_uint();
+        case major_type::negative_int:
+            return read_int();
+        default:
+            break;
+        }
+
+        require(1);
+        auto initial = *pos++;
+        if (initial == 0xFA) {
+            std::uint32_t bits = read_be(4);
+            float value;
+            std::memcpy(&value, &bits, sizeof(value));
+            return value;
+        }
+        if (initial == 0xFB) {
+            std::uint64_t bits = read_be(8);
+            double value;
+            std::memcpy(&value, &bits, sizeof(value));
+            return value;
+        }
+        throw std::invalid_argument{"expecting CBOR number"};
+    }
+
+    void
+    skip(int depth = 0)
+    {
+        check_depth(depth);
+
+        switch (peek_type()) {
+
+        case major_type::unsigned_int:
+        case major_type::negative_int:
+            read_head(peek_type());
+            break;
+
+        case major_type::bytes:
+        case major_type::text:
+            read_string(peek_type());
+            break;
+
+        case major_type::array:
+            for (auto n = read_array_header(); n > 0; n--) {
+                skip(depth + 1);
+            }
+            break;
+
+        case major_type::map:
+            for (auto n = read_map_header(); n > 0; n--) {
+                skip(depth + 1);
+                skip(depth + 1);
+            }
+            break;
+
+        case major_type::tag:
+            read_head(major_type::tag);
+            skip(depth + 1);
+            break;
+
+        case major_type::simple: {
+            auto info = *pos & 0x1F;
+            if (info < 24) { pos += 1; }
+            else if (info == 24) { require(2); pos += 2; }
+            else if (info == 25) { require(3); pos += 3; }
+            else if (info == 26) { require(5); pos += 5; }
+            else if (info == 27) { require(9); pos += 9; }
+            else {
+                throw std::invalid_argument{"unsupported CBOR item"};
+            }
+            break;
+        }
+        }
+    }
+
+private:
+
+    std::uint8_t const *begin;
+    std::uint8_t const *end;
+    std::uint8_t const *pos;
+
+    void
+    require(std::size_t size) const
+    {
+        if (static_cast<std::size_t>(end - pos) < size) {
+            throw std::invalid_argument{"unexpected end of CBOR data"};
+        }
+    }
+
+    std::uint64_t
+    read_be(int size)
+    {
+        require(size);
+        std::uint64_t value = 0;
+        for (int i = 0; i < size; i++) {
+            value = (value << 8) | *pos++;
+        }
+        return value;
+    }
+
+    std::uint64_t
+    read_head(major_type type)
+    {
+        if (peek_type() != type) {
+            throw std::invalid_argument{"unexpected CBOR item type"};
+        }
+
+        auto info = *pos++ & 0x1F;
+        if (info < 24) {
+            return info;
+        }
+        switch (info) {
+        case 24: return read_be(1);
+        case 25: return read_be(2);
+        case 26: return read_be(4);
+        case 27: return read_be(8);
+        default:
+            throw std::invalid_argument{"indefinite CBOR length is not supported"};
+        }
+    }
+
+    std::string
+    read_string(major_type type)
+    {
+        auto size = read_head(type);
+        require(size);
+        std::string str(pos, pos + size);
+        pos += size;
+        return str;
+    }
+};
+
+/**
+ * Generic JSON <-> CBOR conversion
+ */
+
+void
+json_to_cbor(Json::Value const &json, writer &w)
+{
+    switch (json.type()) {
+
+    case Json::nullValue:
+        w.write_null();
+        break;
+
+    case Json::intValue:
+        w.write_int(json.asInt64());
+        break;
+
+    case Json::uintValue:
+        w.write_uint(json.asUInt64());
+        break;
+
+    case Json::realValue:
+        w.write_double(json.asDouble());
+        break;
+
+    case Json::stringValue:
+        w.write_text(json.asString());
+        break;
+
+    case Json::booleanValue:
+        w.write_bool(json.asBool());
+        break;
+
+    case Json::arrayValue:
+        w.write_array_header(json.size());
+        for (auto const &item: json) {
+            json_to_cbor(item, w);
+        }
+        break;
+
+    case Json::objectValue:
+        w.write_map_header(json.size());
+        for (auto const &name: json.getMemberNames()) {
+            w.write_text(name);
+            json_to_cbor(json[name], w);
+        }
+        break;
+    }
+}
+
+Json::Value
+cbor_to_json(reader &r, int depth = 0)
+{
+    check_depth(depth);
+
+    switch (r.peek_type()) {
+
+    case major_type::unsigned_int:
+        return Json::Value::UInt64(r.read_uint());
+
+    case major_type::negative_int:
+        return Json::Value::Int64(r.read_int());
+
+    case major_type::bytes:
+        return utils::hex_encode(r.read_bytes());
+
+    case major_type::text:
+        return r.read_text();
+
+    case major_type::array: {
+        Json::Value json{Json::arrayValue};
+        for (auto n = r.read_array_header(); n > 0; n--) {
+            json.append(cbor_to_json(r, depth + 1));
+        }
+        return json;
+    }
+
+    case major_type::map: {
+        Json::Value json{Json::objectValue};
+        for (auto n = r.read_map_header(); n > 0; n--) {
+            auto name = r.read_text();
+            json[name] = cbor_to_json(r, depth + 1);
+        }
+        return json;
+    }
+
+    case major_type::simple:
+        if (r.peek_null()) {
+            r.read_null();
+            return Json::Value{};
+        }
+        if (r.peek_bool()) {
+            return r.read_bool();
+        }
+        return r.read_double();
+
+    default:
+        throw std::invalid_argument{"unsupported CBOR item"};
+    }
+}
+
+std::string
+json_to_cbor_string(Json::Value const &json)
+{
+    writer w;
+    json_to_cbor(json, w);
+    return std::string(w.data.begin(), w.data.end());
+}
+
+Json::Value
+cbor_string_to_json(std::string const &str)
+{
+    reader r{reinterpret_cast<std::uint8_t const *>(str.data()), str.size()};
+    return cbor_to_json(r);
+}
+
+}
+}
@@ -19,9 +19,17 @@
 
 #include "protobuf/json_codec.hpp"
 #include "protobuf/wire_codec.hpp"
+#include "protobuf/cbor_codec.hpp"
 #include "config/config.pb.h"
 #include "crypto.hpp"
 
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <set>
+
 #include <boost/bind.hpp>
 #include <boost/regex.hpp>
 #include <boost/thread.hpp>
@@ -36,18 +44,238 @@ namespace trezord
 namespace core
 {
 
+/**
+ * Device calls that can be answered from a cache: read-only queries,
+ * chosen by the operator, whose responses only change with the device
+ * state.  Any other call to the device drops its cached responses.
+ */
+
+struct response_cache_policy
+{
+    std::set<std::uint16_t> cacheable_requests;
+    // responses asking for user interaction, or failures
+    std::set<std::uint16_t> uncacheable_responses;
+    // cacheable requests can still ask the device to show something
+    std::function<bool (wire::message const &)> is_interactive;
+
+    bool
+    is_cacheable_request(wire::message const &msg) const
+    {
+        return cacheable_requests.count(msg.id)
+            && !(is_interactive && is_interactive(msg));
+    }
+
+    bool
+    is_cacheable_response(wire::message const &msg) const
+    {
+        return !uncacheable_responses.count(msg.id);
+    }
+};
+
+/**
+ * Cached responses of one device session, keyed by message id and data.
+ * Not synchronized, the device kernel only touches it on its executor.
+ */
+
+struct response_cache
+{
+    using policy_ptr = std::shared_ptr<response_cache_policy const>;
+
+    static const std::size_t max_size = 64;
+
+    // true if the request may be answered from and stored to the cache;
+    // any other request might change the device state and drops the
+    // cached responses, as does a change of the policy
+    bool
+    admit(wire::message const &msg, policy_ptr const &policy)
+    {
+        if (policy != current_policy) {
+            clear(); // reconfigured
+            current_policy = policy;
+        }
+        if (!policy || !policy->is_cacheable_request(msg)) {
+            clear();
+            return false;
+        }
+        return true;
+    }
+
+    bool
+    find(wire::message const &msg_in, wire::message &msg_out) const
+    {
+        auto it = responses.find(key(msg_in));
+        if (it == responses.end()) {
+            return false;
+        }
+        msg_out = it->second;
+        return true;
+    }
+
+    // for admitted requests only
+    void
+    store(wire::message const &msg_in, wire::message const &msg_out)
+    {
+        if (!current_policy->is_cacheable_response(msg_out)) {
+            return;
+        }
+        if (responses.size() >= max_size) {
+            responses.clear();
+        }
+        responses[key(msg_in)] = msg_out;
+    }
+
+    void
+    clear()
+    {
+        responses.clear();
+    }
+
+    std::size_t
+    size() const
+    {
+        return responses.size();
+    }
+
+private:
+
+    std::map<std::string, wire::message> responses;
+    policy_ptr current_policy;
+
+    static
+    std::string
+    key(wire::message const &msg)
+    {
+        std::string key{static_cast<char>(msg.id >> 8), static_cast<char>(msg.id & 0xFF)};
+        key.append(msg.data.begin(), msg.data.end());
+        return key;
+    }
+};
+
 struct device_kernel
 {
     using device_path_type = std::string;
+    using call_callback = std::function<
+        void (std::exception_ptr, wire::message const &)>;
+
+    // fills in the message answering a device response and returns
+    // true, or returns false to end the call with that response
+    using reply_function = std::function<
+        bool (wire::message const &, wire::message &)>;
+
+    using cache_policy_ptr = response_cache::policy_ptr;
 
     device_path_type device_path;
 
+    // when the device was last enumerated or handed out, guarded by the
+    // kernel lock
+    boost::system_time last_used;
+
     device_kernel(device_path_type const &dp)
-        : device_path{dp}
+        : device_path{dp},
+          last_used{boost::get_system_time()}
     {}
 
+    // nothing queued on the device, it can be dropped
+    bool
+    is_idle() const
+    {
+        return executor.pending() == 0;
+    }
+
+    // all device I/O runs on the executor of the device, so calls to
+    // one device are serialized while different devices run in parallel
+
+    // responses are cached per session, so acquiring starts afresh
+
     void
     open()
+    {
+        executor.await([&] {
+                cache.clear();
+                open_device();
+            });
+    }
+
+    void
+    close()
+    {
+        executor.await([&] { close_device(); });
+    }
+
+    template <typename message_type>
+    void
+    call(message_type const &msg_in, wire::message &msg_out,
+         cache_policy_ptr const &policy = nullptr)
+    {
+        executor.await([&] { call_device(msg_in, msg_out, policy); });
+    }
+
+    template <typename message_type>
+    boost::unique_future<wire::message>
+    call_async(message_type const &msg_in,
+               cache_policy_ptr const &policy = nullptr)
+    {
+        return executor.add([=] {
+                wire::message msg_out;
+                call_device(msg_in, msg_out, policy);
+                return msg_out;
+            });
+    }
+
+    template <typename message_type>
+    void
+    call_async(message_type const &msg_in, call_callback callback,
+               cache_policy_ptr const &policy = nullptr)
+    {
+        executor.add([=] {
+                wire::message msg_out;
+                std::exception_ptr eptr;
+                try {
+                    call_device(msg_in, msg_out, policy);
+                }
+                catch (...) {
+                    eptr = std::current_exception();
+                }
+                callback(eptr, msg_out);
+            });
+    }
+
+    // responses answered by reply are written back within the same
+    // executor task, so no other call gets between them
+    template <typename message_type>
+    void
+    call_async(message_type const &msg_in,
+               reply_function reply,
+               call_callback callback,
+               cache_policy_ptr const &policy = nullptr)
+    {
+        executor.add([=] {
+                wire::message msg_out;
+                wire::message msg_reply;
+                std::exception_ptr eptr;
+                try {
+                    call_device(msg_in, msg_out, policy);
+                    while (reply(msg_out, msg_reply)) {
+                        call_device(msg_reply, msg_out, policy);
+                    }
+                }
+                catch (...) {
+                    eptr = std::current_exception();
+                }
+                callback(eptr, msg_out);
+            });
+    }
+
+private:
+
+    std::unique_ptr< wire::device > device;
+    utils::async_executor executor;
+
+    // only touched on the executor
+    response_cache cache;
+
+    void
+    open_device()
     {
         if (device.get() == nullptr) {
             CLOG(INFO, "core.device") << "opening: " << device_path;
@@ -56,18 +284,47 @@ struct device_kernel
     }
 
     void
-    close()
+    close_device()
     {
         CLOG(INFO, "core.device") << "closing: " << device_path;
+        cache.clear();
         device.reset();
     }
 
     void
-    call(wire::message const &msg_in, wire::message &msg_out)
+    call_device(wire::message const &msg_in, wire::message &msg_out,
+                cache_policy_ptr const &policy)
+    {
+        auto cacheable = cache.admit(msg_in, policy);
+        if (cacheable && cache.find(msg_in, msg_out)) {
+            CLOG(INFO, "core.device") << "cached response: " << device_path;
+            return;
+        }
+
+        transfer(msg_in, msg_out);
+
+        if (cacheable) {
+            cache.store(msg_in, msg_out);
+        }
+    }
+
+    // bytes messages carry firmware and the like, they are never cached
+    // and might change the device state
+    void
+    call_device(wire::bytes_message const &msg_in, wire::message &msg_out,
+                cache_policy_ptr const &policy)
+    {
+        cache.clear();
+        transfer(msg_in, msg_out);
+    }
+
+    template <typename message_type>
+    void
+    transfer(message_type const &msg_in, wire::message &msg_out)
     {
         CLOG(INFO, "core.device") << "calling: " << device_path;
         if (!device.get()) {
-            open();
+            open_device();
         }
         try {
             msg_in.write_to(*device);
@@ -75,14 +332,10 @@ struct device_kernel
         }
         catch (std::exception const &e) {
             CLOG(ERROR, "core.device") << e.what();
-            close();
+            close_device();
             throw;
         }
     }
-
-private:
-
-    std::unique_ptr< wire::device > device;
 };
 
 struct kernel_config
@@ -98,37 +351,77 @@ struct kernel_config
     {
         auto data = verify_signature(str);
         c.ParseFromArray(data.first, data.second);
+        compile_url_patterns();
+        signed_string = str;
+    }
+
+    // files contain the hex-encoded signed string, same as /configure
+
+    void
+    parse_from_file(std::string const &path)
+    {
+        std::ifstream file{path, std::ios::binary};
+        if (!file) {
+            throw invalid_config{"cannot read configuration file"};
+        }
+        std::string hex{std::istreambuf_iterator<char>{file},
+                        std::istreambuf_iterator<char>{}};
+        boost::algorithm::trim(hex);
+        parse_from_signed_string(utils::hex_decode(hex));
+    }
+
+    void
+    save_to_file(std::string const &path) const
+    {
+        // written aside and renamed over the old file, which stays
+        // intact if the bridge dies or the disk fills up meanwhile
+        auto tmp_path = path + ".tmp";
+        std::ofstream file{tmp_path, std::ios::binary | std::ios::trunc};
+        file << utils::hex_encode(signed_string);
+        if (!file.flush()) {
+            file.close();
+            std::remove(tmp_path.c_str());
+            throw std::runtime_error{"cannot write configuration file"};
+        }
+        file.close();
+
+#ifdef _WIN32
+        // rename does not replace an existing file here
+        std::remove(path.c_str());
+#endif
+        if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+            std::remove(tmp_path.c_str());
+            throw std::runtime_error{"cannot replace configuration file"};
+        }
+    }
+
+    // true if this config was parsed from exactly the given string
+    bool
+    is_parsed_from(std::string const &str) const
+    {
+        return is_initialized() && signed_string == str;
     }
 
     bool
-    is_initialized()
+    is_initialized() const
     {
         return c.IsInitialized();
     }
 
     bool
-    is_unexpired()
+    is_unexpired() const
     {
         auto current_time = std::time(nullptr);
         return !c.has_valid_until() || c.valid_until() > current_time;
     }
 
     bool
-    is_url_allowed(std::string const &url)
+    is_url_allowed(std::string const &url) const
     {
-        bool whitelisted = std::any_of(
-            c.whitelist_urls().begin(),
-            c.whitelist_urls().end(),
-            [&] (std::string const &pattern) {
-                return boost::regex_match(url, boost::regex{pattern});
-            });
-
-        bool blacklisted = std::any_of(
-            c.blacklist_urls().begin(),
-            c.blacklist_urls().end(),
-            [&] (std::string const &pattern) {
-                return boost::regex_match(url, boost::regex{pattern});
-            });
+        bool whitelisted = c.whitelist_urls_size() > 0
+            && boost::regex_match(url, whitelist);
+        bool blacklisted = c.blacklist_urls_size() > 0
+            && boost::regex_match(url, blacklist);
 
         return whitelisted && !blacklisted;
     }
@@ -143,6 +436,39 @@ struct kernel_config
 
 private:
 
+    std::string signed_string;
+
+    // all patterns of a list merged into one alternation, compiled once
+    boost::regex whitelist;
+    boost::regex blacklist;
+
+    void
+    compile_url_patterns()
+    {
+        try {
+            whitelist = merge_url_patterns(c.whitelist_urls());
+            blacklist = merge_url_patterns(c.blacklist_urls());
+        }
+        catch (boost::regex_error const &e) {
+            throw invalid_config{"configuration contains invalid url pattern"};
+        }
+    }
+
+    static
+    boost::regex
+    merge_url_patterns(
+        google::protobuf::RepeatedPtrField<std::string> const &patterns)
+    {
+        std::string merged;
+        for (auto const &pattern: patterns) {
+            if (!merged.empty()) {
+                merged += '|';
+            }
+            merged += "(?:" + pattern + ")";
+        }
+        return boost::regex{merged};
+    }
+
     std::pair<std::uint8_t const *, std::size_t>
     verify_signature(std::string const &str)
     {
@@ -168,6 +494,183 @@ private:
     }
 };
 
+/**
+ * Protobuf state and codecs built from the wire protocol of a config.
+ * Building them is expensive, so configs with the same wire protocol
+ * share one schema.
+ */
+
+struct kernel_schema
+{
+    // serialized FileDescriptorSet the schema was built from
+    std::string const wire_protocol;
+
+    // empty schema of an unconfigured kernel
+    kernel_schema()
+        : kernel_schema{std::string{}}
+    { }
+
+    explicit kernel_schema(protobuf::pb::FileDescriptorSet const &set)
+        : kernel_schema{set.SerializeAsString()}
+    {
+        pb_state->load_from_set(set);
+        pb_wire_codec->load_protobuf_state();
+    }
+
+    kernel_schema(kernel_schema const &) = delete;
+    kernel_schema &operator=(kernel_schema const &) = delete;
+
+    // protobuf <-> json codec
+
+    void
+    json_to_wire(Json::Value const &json, wire::message &wire,
+                 protobuf::bytes_encoding encoding) const
+    {
+        protobuf_ptr pbuf{pb_json_codec->typed_json_to_protobuf(json, encoding)};
+        pb_wire_codec->protobuf_to_wire(*pbuf, wire);
+    }
+
+    void
+    wire_to_json(wire::message const &wire, Json::Value &json,
+                 protobuf::bytes_encoding encoding) const
+    {
+        protobuf_ptr pbuf{pb_wire_codec->wire_to_protobuf(wire)};
+        json = pb_json_codec->protobuf_to_typed_json(*pbuf, encoding);
+    }
+
+    // protobuf <-> cbor codec
+
+    void
+    cbor_to_wire(std::string const &cbor, wire::message &wire) const
+    {
+        cbor::reader reader{
+            reinterpret_cast<std::uint8_t const *>(cbor.data()), cbor.size()};
+        protobuf_ptr pbuf{pb_cbor_codec->typed_cbor_to_protobuf(reader)};
+        pb_wire_codec->protobuf_to_wire(*pbuf, wire);
+    }
+
+    void
+    wire_to_cbor(wire::message const &wire, std::string &cbor) const
+    {
+        protobuf_ptr pbuf{pb_wire_codec->wire_to_protobuf(wire)};
+        cbor::writer writer;
+        pb_cbor_codec->protobuf_to_typed_cbor(*pbuf, writer);
+        cbor.assign(writer.data.begin(), writer.data.end());
+    }
+
+    std::uint16_t
+    find_message_id(std::string const &name) const
+    {
+        return pb_wire_codec->find_message_id(name);
+    }
+
+    std::uint16_t
+    find_bytes_message_id(std::string const &name) const
+    {
+        return pb_wire_codec->find_bytes_message_id(name);
+    }
+
+    // true if the message has a bool field of that name set, like
+    // show_display
+    bool
+    is_flag_set(wire::message const &wire, std::string const &name) const
+    {
+        protobuf_ptr pbuf{pb_wire_codec->wire_to_protobuf(wire)};
+        auto fd = pbuf->GetDescriptor()->FindFieldByName(name);
+        return fd && !fd->is_repeated()
+            && fd->type() == protobuf::pb::FieldDescriptor::TYPE_BOOL
+            && pbuf->GetReflection()->GetBool(*pbuf, fd);
+    }
+
+private:
+
+    using protobuf_ptr = std::unique_ptr<protobuf::pb::Message>;
+
+    std::unique_ptr<protobuf::state> pb_state;
+    std::unique_ptr<protobuf::wire_codec> pb_wire_codec;
+    std::unique_ptr<protobuf::json_codec> pb_json_codec;
+    std::unique_ptr<protobuf::cbor_codec> pb_cbor_codec;
+
+    explicit kernel_schema(std::string const &serialized)
+        : wire_protocol(serialized),
+          pb_state{new protobuf::state{}},
+          pb_wire_codec{new protobuf::wire_codec{pb_state.get()}},
+          pb_json_codec{new protobuf::json_codec{pb_state.get()}},
+          pb_cbor_codec{new protobuf::cbor_codec{pb_state.get()}}
+    { }
+};
+
+/**
+ * Configuration together with the schema built from it.  Snapshots are
+ * never modified after being published, so readers need no locking and
+ * keep a consistent view while a new configuration is being set.
+ */
+
+struct kernel_snapshot
+{
+    using schema_ptr = std::shared_ptr<kernel_schema const>;
+    using cache_policy_ptr = device_kernel::cache_policy_ptr;
+
+    kernel_config const config;
+    schema_ptr const schema;
+    // null if response caching is disabled
+    cache_policy_ptr const cache_policy;
+
+    kernel_snapshot(kernel_config const &cfg,
+                    schema_ptr const &sch,
+                    cache_policy_ptr const &policy = nullptr)
+        : config(cfg),
+          schema{sch},
+          cache_policy{policy},
+          url_verdicts{std::make_shared<verdict_map>()}
+    { }
+
+    kernel_snapshot(kernel_snapshot const &) = delete;
+    kernel_snapshot &operator=(kernel_snapshot const &) = delete;
+
+    bool
+    is_url_allowed(std::string const &url) const
+    {
+        // verdicts are cached per snapshot, so reconfiguring drops them;
+        // the cache is copied on insert and published with a CAS, misses
+        // are rare as there are only a few origins in practice
+        auto verdicts = std::atomic_load(&url_verdicts);
+        auto it = verdicts->find(url);
+        if (it != verdicts->end()) {
+            return it->second;
+        }
+
+        bool allowed = config.is_url_allowed(url);
+
+        for (;;) {
+            // origins come from arbitrary pages, keep the cache bounded
+            std::shared_ptr<verdict_map> updated;
+            if (verdicts->size() >= max_url_verdicts) {
+                updated = std::make_shared<verdict_map>();
+            }
+            else {
+                updated = std::make_shared<verdict_map>(*verdicts);
+            }
+            (*updated)[url] = allowed;
+
+            verdict_map_ptr updated_const = updated;
+            if (std::atomic_compare_exchange_weak(
+                    &url_verdicts, &verdicts, updated_const)) {
+                return allowed;
+            }
+        }
+    }
+
+private:
+
+    using verdict_map = std::map<std::string, bool>;
+    using verdict_map_ptr = std::shared_ptr<verdict_map const>;
+
+    static const std::size_t max_url_verdicts = 256;
+
+    mutable verdict_map_ptr url_verdicts;
+};
+
 struct kernel
 {
     using session_id_type = std::string;
@@ -188,12 +691,36 @@ struct kernel
         : public std::invalid_argument
     { using std::invalid_argument::invalid_argument; };
 
+    struct unknown_device
+        : public std::invalid_argument
+    { using std::invalid_argument::invalid_argument; };
+
+    // zero or empty fields match any device, like in hid::enumerate
+    struct device_filter
+    {
+        std::uint16_t vendor_id = 0;
+        std::uint16_t product_id = 0;
+        std::string serial_number;
+
+        bool
+        matches(wire::device_info const &info) const
+        {
+            return (vendor_id == 0 || vendor_id == info.vendor_id)
+                && (product_id == 0 || product_id == info.product_id)
+                && (serial_number.empty() || serial_number == info.serial_number);
+        }
+    };
+
 public:
 
-    kernel()
-        : pb_state{new protobuf::state{}},
-          pb_wire_codec{new protobuf::wire_codec{pb_state.get()}},
-          pb_json_codec{new protobuf::json_codec{pb_state.get()}}
+    // configuration set by clients is saved to config_path, if not empty;
+    // responses to cacheable_messages are cached per device session
+    explicit kernel(std::string const &config_path = std::string{},
+                    std::set<std::string> const &cacheable_messages = {})
+        : config_path{config_path},
+          cacheable_messages{cacheable_messages},
+          snapshot{std::make_shared<kernel_snapshot>(
+                kernel_config{}, std::make_shared<kernel_schema>())}
     {
         hid::init();
     }
@@ -207,40 +734,80 @@ public:
     get_version()
     { return VERSION; }
 
+    using snapshot_ptr = std::shared_ptr<kernel_snapshot const>;
+
+    snapshot_ptr
+    get_snapshot() const
+    { return std::atomic_load(&snapshot); }
+
     bool
-    has_config()
-    { return config.is_initialized(); }
+    has_config() const
+    { return get_snapshot()->config.is_initialized(); }
 
-    kernel_config const &
-    get_config()
-    { return config; }
+    std::shared_ptr<kernel_config const>
+    get_config() const
+    {
+        auto current = get_snapshot();
+        return {current, &current->config};
+    }
 
     void
     set_config(kernel_config const &new_config)
     {
-        lock_type lock{mutex};
-
-        config = new_config;
-
-        pb_state.reset(new protobuf::state{});
-        pb_state->load_from_set(config.c.wire_protocol());
-
-        pb_wire_codec.reset(new protobuf::wire_codec{pb_state.get()});
-        pb_wire_codec->load_protobuf_state();
+        // the saved configuration is always the published one, even
+        // when clients configure concurrently
+        boost::unique_lock<boost::mutex> lock{config_mutex};
+
+        publish_config(new_config);
+
+        if (!config_path.empty()) {
+            try {
+                new_config.save_to_file(config_path);
+            }
+            catch (std::exception const &e) {
+                CLOG(ERROR, "core.config") << e.what() << ": " << config_path;
+            }
+        }
+    }
 
-        pb_json_codec.reset(new protobuf::json_codec{pb_state.get()});
+    // restores a configuration saved to a file, verifying it the same
+    // way as a configuration posted by a client
+    bool
+    restore_config(std::string const &path)
+    {
+        try {
+            kernel_config config;
+            config.parse_from_file(path);
+
+            if (!config.is_initialized()) {
+                throw kernel_config::invalid_config{"configuration is incomplete"};
+            }
+            if (!config.is_unexpired()) {
+                throw kernel_config::invalid_config{"configuration is expired"};
+            }
+
+            publish_config(config);
+            CLOG(INFO, "core.config") << "restored configuration from: " << path;
+            return true;
+        }
+        catch (std::exception const &e) {
+            CLOG(INFO, "core.config")
+                << "not restoring configuration from: " << path
+                << ", " << e.what();
+            return false;
+        }
     }
 
     bool
-    is_allowed(std::string const &url)
+    is_allowed(std::string const &url) const
     {
-        lock_type lock{mutex};
+        auto current = get_snapshot();
 
-        if (!has_config()) {
+        if (!current->config.is_initialized()) {
             return true;
         }
 
-        return config.is_unexpired() && config.is_url_allowed(url);
+        return current->config.is_unexpired() && current->is_url_allowed(url);
     }
 
     // device enumeration
@@ -258,22 +825,43 @@ public:
     device_enumeration_type
     enumerate_devices()
     {
-        lock_type lock{mutex};
-
         if (!has_config()) {
             throw missing_config{"not configured"};
         }
 
+        // hid calls are serialized on their own, enumerating takes a while
+        // and does not need to hold up sessions meanwhile
+        auto devices = enumerate_supported_devices();
+
+        lock_type lock{mutex};
         device_enumeration_type list;
 
-        for (auto const &i: enumerate_supported_devices()) {
+        for (auto const &i: devices) {
             auto session_id = find_session_by_path(i.path);
             list.emplace_back(i, session_id);
         }
 
+        prune_device_kernels(devices);
         return list;
     }
 
+    // device paths are reassigned when devices are reconnected, so the
+    // serial number is looked up in a fresh enumeration every time
+    device_path_type
+    find_device_path_by_serial(std::string const &serial_number)
+    {
+        if (!has_config()) {
+            throw missing_config{"not configured"};
+        }
+
+        for (auto const &i: enumerate_supported_devices()) {
+            if (!serial_number.empty() && i.serial_number == serial_number) {
+                return i.path;
+            }
+        }
+        throw unknown_device{"device not found"};
+    }
+
     // device kernels
 
     device_kernel *
@@ -290,6 +878,7 @@ public:
             std::forward_as_tuple(device_path),
             std::forward_as_tuple(device_path));
 
+        kernel_r.first->second.last_used = boost::get_system_time();
         return &kernel_r.first->second;
     }
 
@@ -353,6 +942,38 @@ public:
         }
     }
 
+    // acquires a session on the first device of an enumeration that
+    // matches the filter and has none; the enumeration is taken outside
+    // of the lock, sessions are checked again under it
+    bool
+    acquire_free_device(device_filter const &filter,
+                        device_enumeration_type const &devices,
+                        std::pair<wire::device_info, session_id_type> &acquired)
+    {
+        lock_type lock{mutex};
+
+        if (!has_config()) {
+            throw missing_config{"not configured"};
+        }
+
+        for (auto const &d: devices) {
+            auto const &i = d.first;
+            if (!filter.matches(i) || !find_session_by_path(i.path).empty()) {
+                continue;
+            }
+            try {
+                get_device_kernel(i.path)->open();
+            }
+            catch (std::exception const &e) {
+                // unplugged since the enumeration, or used by another app
+                CLOG(INFO, "core.kernel") << "cannot open: " << i.path << ", " << e.what();
+                continue;
+            }
+            acquired = std::make_pair(i, acquire_session(i.path));
+            return true;
+        }
+        return false;
+    }
 
     session_id_type
     open_and_acquire_session(device_path_type const &device_path,
@@ -382,47 +1003,212 @@ public:
         release_session(session_id);
     }
 
+    // device calls do not take the kernel lock, device_kernel serializes
+    // them on its own executor
+
+    template <typename message_type>
     void
-    call_device(device_kernel *device, wire::message const &msg_in, wire::message &msg_out)
+    call_device(device_kernel *device, message_type const &msg_in, wire::message &msg_out)
     {
-        lock_type lock{mutex};
-        device->call(msg_in, msg_out);
+        device->call(msg_in, msg_out, get_snapshot()->cache_policy);
     }
 
-    // protobuf <-> json codec
+    template <typename message_type>
+    boost::unique_future<wire::message>
+    call_device_async(device_kernel *device, message_type const &msg_in)
+    {
+        return device->call_async(msg_in, get_snapshot()->cache_policy);
+    }
 
+    template <typename message_type>
     void
-    json_to_wire(Json::Value const &json, wire::message &wire)
+    call_device_async(device_kernel *device,
+                      message_type const &msg_in,
+                      device_kernel::call_callback callback)
     {
-        lock_type lock{mutex};
-        protobuf_ptr pbuf{pb_json_codec->typed_json_to_protobuf(json)};
-        pb_wire_codec->protobuf_to_wire(*pbuf, wire);
+        device->call_async(msg_in, callback, get_snapshot()->cache_policy);
     }
 
+    template <typename message_type>
     void
-    wire_to_json(wire::message const &wire, Json::Value &json)
+    call_device_async(device_kernel *device,
+                      message_type const &msg_in,
+                      device_kernel::reply_function reply,
+                      device_kernel::call_callback callback)
     {
-        lock_type lock{mutex};
-        protobuf_ptr pbuf{pb_wire_codec->wire_to_protobuf(wire)};
-        json = pb_json_codec->protobuf_to_typed_json(*pbuf);
+        device->call_async(msg_in, reply, callback, get_snapshot()->cache_policy);
+    }
+
+    std::uint16_t
+    find_bytes_message_id(std::string const &name) const
+    {
+        return get_snapshot()->schema->find_bytes_message_id(name);
+    }
+
+    // protobuf <-> json codec, see kernel_schema for conversions that
+    // have to use the same schema
+
+    void
+    json_to_wire(Json::Value const &json, wire::message &wire,
+                 protobuf::bytes_encoding encoding = protobuf::bytes_encoding::hex) const
+    {
+        get_snapshot()->schema->json_to_wire(json, wire, encoding);
+    }
+
+    void
+    wire_to_json(wire::message const &wire, Json::Value &json,
+                 protobuf::bytes_encoding encoding = protobuf::bytes_encoding::hex) const
+    {
+        get_snapshot()->schema->wire_to_json(wire, json, encoding);
+    }
+
+    // protobuf <-> cbor codec
+
+    void
+    cbor_to_wire(std::string const &cbor, wire::message &wire) const
+    {
+        get_snapshot()->schema->cbor_to_wire(cbor, wire);
+    }
+
+    void
+    wire_to_cbor(wire::message const &wire, std::string &cbor) const
+    {
+        get_snapshot()->schema->wire_to_cbor(wire, cbor);
+    }
+
+    // policy caching responses to cacheable_messages, or none if empty
+    static
+    kernel_snapshot::cache_policy_ptr
+    make_cache_policy(kernel_snapshot::schema_ptr const &schema,
+                      std::set<std::string> const &cacheable_messages)
+    {
+        static const char *uncacheable_responses[] = {
+            "Failure",
+            "ButtonRequest",
+            "PinMatrixRequest",
+            "PassphraseRequest",
+            "PassphraseStateRequest",
+            "WordRequest"
+        };
+
+        if (cacheable_messages.empty()) {
+            return nullptr;
+        }
+
+        // messages missing in the protocol are skipped
+        auto find_id = [&] (std::string const &name, std::set<std::uint16_t> &ids) {
+            try {
+                ids.insert(schema->find_message_id(name));
+            }
+            catch (std::invalid_argument const &e) { }
+        };
+
+        auto policy = std::make_shared<response_cache_policy>();
+        for (auto const &name: cacheable_messages) {
+            find_id(name, policy->cacheable_requests);
+        }
+        for (auto const &name: uncacheable_responses) {
+            find_id(name, policy->uncacheable_responses);
+        }
+        policy->is_interactive = [schema] (wire::message const &msg) {
+            return schema->is_flag_set(msg, "show_display");
+        };
+        return policy;
     }
 
 private:
 
-    using protobuf_ptr = std::unique_ptr<protobuf::pb::Message>;
     using lock_type = boost::unique_lock<boost::recursive_mutex>;
 
+    // guards device kernels and sessions, configuration lives in the
+    // snapshot and is read without locking
     boost::recursive_mutex mutex;
 
-    kernel_config config;
-    std::unique_ptr<protobuf::state> pb_state;
-    std::unique_ptr<protobuf::wire_codec> pb_wire_codec;
-    std::unique_ptr<protobuf::json_codec> pb_json_codec;
+    // serializes set_config, the snapshot and the file change together
+    boost::mutex config_mutex;
+
+    std::string config_path;
+    std::set<std::string> const cacheable_messages;
+    snapshot_ptr snapshot;
+
+    void
+    publish_config(kernel_config const &new_config)
+    {
+        // build outside of the kernel lock, readers keep using the old
+        // snapshot until the new one is published
+        auto schema = get_schema(new_config.c.wire_protocol());
+        snapshot_ptr new_snapshot = std::make_shared<kernel_snapshot>(
+            new_config, schema, make_cache_policy(schema, cacheable_messages));
+        std::atomic_store(&snapshot, new_snapshot);
+    }
+
+    // schemas in use by some snapshot, by hash of their wire protocol
+    boost::mutex schemas_mutex;
+    std::multimap<std::size_t, std::weak_ptr<kernel_schema const>> schemas;
+
+    kernel_snapshot::schema_ptr
+    get_schema(protobuf::pb::FileDescriptorSet const &set)
+    {
+        auto serialized = set.SerializeAsString();
+        auto hash = std::hash<std::string>{}(serialized);
+
+        boost::unique_lock<boost::mutex> lock{schemas_mutex};
+
+        for (auto it = schemas.begin(); it != schemas.end(); ) {
+            auto schema = it->second.lock();
+            if (!schema) {
+                it = schemas.erase(it);
+                continue;
+            }
+            if (it->first == hash && schema->wire_protocol == serialized) {
+                CLOG(INFO, "core.kernel") << "reusing protocol schema";
+                return schema;
+            }
+            ++it;
+        }
+
+        kernel_snapshot::schema_ptr schema = std::make_shared<kernel_schema>(set);
+        schemas.emplace(hash, schema);
+        return schema;
+    }
 
     std::map<device_path_type, device_kernel> device_kernels;
     std::map<device_path_type, session_id_type> sessions;
     boost::uuids::random_generator uuid_generator;
 
+    // every reconnect gets a new device path, kernels of devices that are
+    // gone are dropped so their threads do not pile up; the grace period
+    // covers device kernels just handed out, but not called yet
+    void
+    prune_device_kernels(wire::device_info_list const &devices)
+    {
+        static const auto grace_period = boost::posix_time::seconds(60);
+
+        auto now = boost::get_system_time();
+
+        for (auto it = device_kernels.begin(); it != device_kernels.end(); ) {
+            auto &device = it->second;
+            auto connected = std::any_of(
+                devices.begin(),
+                devices.end(),
+                [&] (wire::device_info const &i) { return i.path == it->first; });
+
+            if (connected) {
+                device.last_used = now;
+            }
+            if (connected
+                || sessions.count(it->first)
+                || !device.is_idle()
+                || now - device.last_used < grace_period) {
+                ++it;
+                continue;
+            }
+
+            CLOG(INFO, "core.kernel") << "dropping device kernel: " << it->first;
+            it = device_kernels.erase(it);
+        }
+    }
+
     session_id_type
     generate_session_id()
     {
@@ -441,14 +1227,17 @@ private:
     bool
     is_device_supported(hid_device_info const *info)
     {
+        auto const &c = get_snapshot()->config.c;
         return std::any_of(
-            config.c.known_devices().begin(),
-            config.c.known_devices().end(),
+            c.known_devices().begin(),
+            c.known_devices().end(),
             [&] (DeviceDescriptor const &dd) {
                 return (!dd.has_vendor_id()
                         || dd.vendor_id() == info->vendor_id)
                     && (!dd.has_product_id()
-                        || dd.product_id() == info->product_id);
+                        || dd.product_id() == info->product_id)
+                    && (!dd.has_serial_number()
+                        || dd.serial_number() == wire::serial_number_of(info));
             });
     }
 };
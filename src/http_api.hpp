@@ -18,13 +18,18 @@
  */
 
 #include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
 
+#include <atomic>
+#include <climits>
 #include <exception>
 #include <functional>
 #include <iostream>
 #include <string>
+#include <list>
 #include <locale>
 #include <map>
+#include <set>
 
 namespace trezord
 {
@@ -62,6 +67,76 @@ json_response(int status, json_list const &list)
     return json_response(status, json_value(list));
 }
 
+/**
+ * Content negotiation
+ */
+
+bool
+has_content_type(http_server::request_data const &request,
+                 std::string const &type)
+{
+    auto content_type = request.get_header("Content-Type");
+    return content_type
+        && std::string{content_type}.compare(0, type.size(), type) == 0;
+}
+
+bool
+is_cbor_request(http_server::request_data const &request)
+{
+    return has_content_type(request, "application/cbor");
+}
+
+bool
+is_cbor_accepted(http_server::request_data const &request)
+{
+    auto accept = request.get_header("Accept");
+    return accept
+        && std::string{accept}.find("application/cbor") != std::string::npos;
+}
+
+Json::Value
+request_body_to_json(http_server::request_data const &request)
+{
+    auto const &body = request.body;
+    Json::Value json;
+
+    if (is_cbor_request(request)) {
+        json = cbor::cbor_string_to_json(body);
+    }
+    else {
+        Json::Reader json_reader;
+        json_reader.parse(body.data(), body.data() + body.size(), json);
+    }
+    return json;
+}
+
+http_server::response_data
+cbor_response(int status, std::string const &body)
+{
+    http_server::response_data response{status, body};
+    response.add_header("Content-Type", "application/cbor");
+    return response;
+}
+
+http_server::response_data
+negotiated_response(http_server::request_data const &request,
+                    int status,
+                    Json::Value const &body)
+{
+    if (is_cbor_accepted(request)) {
+        return cbor_response(status, cbor::json_to_cbor_string(body));
+    }
+    return json_response(status, body);
+}
+
+http_server::response_data
+negotiated_response(http_server::request_data const &request,
+                    int status,
+                    json_list const &list)
+{
+    return negotiated_response(request, status, json_value(list));
+}
+
 /**
  * Generic error support
  */
@@ -100,6 +175,128 @@ json_error_response(std::exception_ptr eptr)
     }
 }
 
+/**
+ * Bytes fields encoding
+ */
+
+protobuf::bytes_encoding
+request_bytes_encoding(http_server::request_data const &request)
+{
+    auto name = request.get_header("X-Bytes-Encoding");
+    if (!name) {
+        name = request.get_argument("bytes_encoding");
+    }
+
+    if (!name || std::strcmp(name, "hex") == 0) {
+        return protobuf::bytes_encoding::hex;
+    }
+    if (std::strcmp(name, "base64") == 0) {
+        return protobuf::bytes_encoding::base64;
+    }
+    throw response_error{400, "unknown bytes encoding"};
+}
+
+/**
+ * Button request handling
+ */
+
+// with auto mode the bridge answers ButtonRequest with ButtonAck itself
+bool
+is_button_ack_requested(http_server::request_data const &request)
+{
+    auto mode = request.get_header("X-Button-Ack");
+    if (!mode) {
+        mode = request.get_argument("button_ack");
+    }
+
+    if (!mode || std::strcmp(mode, "client") == 0) {
+        return false;
+    }
+    if (std::strcmp(mode, "auto") == 0) {
+        return true;
+    }
+    throw response_error{400, "unknown button ack mode"};
+}
+
+void
+add_button_requests_header(http_server::response_data &response,
+                           std::vector<wire::message> const &buttons)
+{
+    auto count = boost::lexical_cast<std::string>(buttons.size());
+    response.add_header("X-Button-Requests", count.c_str());
+}
+
+/**
+ * Binary message support
+ */
+
+bool
+is_binary_request(http_server::request_data const &request)
+{
+    return has_content_type(request, "application/octet-stream");
+}
+
+bool
+is_framed_request(http_server::request_data const &request)
+{
+    return !request.get_header("X-Message-Id");
+}
+
+void
+binary_to_wire(http_server::request_data const &request, wire::message &wire)
+{
+    auto const &body = request.body;
+    auto data = reinterpret_cast<std::uint8_t const *>(body.data());
+
+    if (is_framed_request(request)) {
+        try {
+            wire.read_from_frame(data, body.size());
+        }
+        catch (wire::message::header_read_error const &e) {
+            throw response_error{400, e.what()};
+        }
+    }
+    else {
+        std::uint32_t id;
+        try {
+            id = boost::lexical_cast<std::uint32_t>(
+                request.get_header("X-Message-Id"));
+        }
+        catch (boost::bad_lexical_cast const &e) {
+            throw response_error{400, "message id is malformed"};
+        }
+        if (id > 0xFFFF) {
+            throw response_error{400, "message id is malformed"};
+        }
+        wire.id = id;
+        wire.data.assign(data, data + body.size());
+    }
+}
+
+http_server::response_data
+binary_response(int status, wire::message const &wire, bool framed)
+{
+    std::vector<std::uint8_t> frame;
+    char const *body;
+    std::size_t body_size;
+
+    if (framed) {
+        wire.write_to_frame(frame);
+        body = reinterpret_cast<char const *>(frame.data());
+        body_size = frame.size();
+    }
+    else {
+        body = reinterpret_cast<char const *>(wire.data.data());
+        body_size = wire.data.size();
+    }
+
+    auto id = boost::lexical_cast<std::string>(wire.id);
+    http_server::response_data response{status, std::string{body, body_size}};
+    response.add_header("Content-Type", "application/octet-stream");
+    response.add_header("X-Message-Id", id.c_str());
+    return response;
+}
+
 /**
  * Device types encoding/decoding
  */
@@ -130,6 +327,7 @@ devices_to_json(core::kernel::device_enumeration_type const &devices)
         item["path"] = encode_device_path(i.path);
         item["vendor"] = i.vendor_id;
         item["product"] = i.product_id;
+        item["serial"] = i.serial_number.empty() ? nil : i.serial_number;
         item["session"] = s.empty() ? nil : s;
         list.append(item);
     }
@@ -138,37 +336,241 @@ devices_to_json(core::kernel::device_enumeration_type const &devices)
 }
 
 const core::kernel::device_enumeration_type
-json_to_devices(std::string const &json_body)
+json_to_devices(Json::Value const &json_message)
 {
-    Json::Value json_message;
-    Json::Reader json_reader;
-    json_reader.parse(json_body, json_message);
     core::kernel::device_enumeration_type list;
     for (auto const &item: json_message) {
         auto path = decode_device_path(item["path"].asString());
         auto vendor = static_cast<std::uint16_t>(item["vendor"].asUInt());
         auto product = static_cast<std::uint16_t>(item["product"].asUInt());
 
+        auto json_serial = item["serial"];
+        auto serial = json_serial.isNull() ? "" : json_serial.asString();
+
         auto json_session = item["session"];
         auto session = json_session.isNull() ? "" : json_session.asString();
 
         auto device_info = wire::device_info{
                 vendor,
                 product,
-                path};
+                path,
+                serial};
 
         list.emplace_back(device_info, session);
     }
     return list;
 }
 
+// clients from before serial numbers were listed post lists without
+// them, which never match an enumeration of devices that have one
+bool
+lists_serials(Json::Value const &json_message)
+{
+    for (auto const &item: json_message) {
+        if (!item.isMember("serial")) {
+            return false;
+        }
+    }
+    return true;
+}
+
+core::kernel::device_enumeration_type
+without_serials(core::kernel::device_enumeration_type devices)
+{
+    for (auto &d: devices) {
+        d.first.serial_number.clear();
+    }
+    return devices;
+}
+
+/**
+ * Device watch
+ *
+ * Requests waiting for the connected devices to change are checked by a
+ * single thread, enumerating once per tick for all of them, so no request
+ * holds a handler thread while it waits.
+ */
+
+struct device_watch
+{
+    // called with every enumeration, or with the error of enumerating,
+    // returns true once it has completed its request
+    using watcher = std::function<
+        bool (core::kernel::device_enumeration_type const &,
+              std::exception_ptr)
+        >;
+
+    explicit device_watch(core::kernel &k)
+        : kernel(k),
+          thread{&device_watch::run, this}
+    { }
+
+    ~device_watch()
+    {
+        stop();
+    }
+
+    // joins the thread and drops the watchers without calling them, the
+    // requests they would complete are answered by the server
+    void
+    stop()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock{mutex};
+            stopping = true;
+            cond_var.notify_all();
+        }
+        if (thread.joinable()) {
+            thread.join();
+        }
+        boost::unique_lock<boost::mutex> lock{mutex};
+        watchers.clear();
+    }
+
+    void
+    add(watcher w)
+    {
+        boost::unique_lock<boost::mutex> lock{mutex};
+        if (stopping) {
+            return;
+        }
+        watchers.push_back(std::move(w));
+        cond_var.notify_all();
+    }
+
+    // checks the watchers without waiting for the next tick
+    void
+    wake()
+    {
+        boost::unique_lock<boost::mutex> lock{mutex};
+        woken = true;
+        cond_var.notify_all();
+    }
+
+private:
+
+    core::kernel &kernel;
+
+    boost::mutex mutex;
+    boost::condition_variable cond_var;
+    std::list<watcher> watchers;
+    bool woken = false;
+    bool stopping = false;
+
+    boost::thread thread;
+
+    void
+    run()
+    {
+        static const auto poll_interval = boost::posix_time::milliseconds(500);
+
+        boost::unique_lock<boost::mutex> lock{mutex};
+
+        while (!stopping) {
+            if (watchers.empty()) {
+                woken = false;
+                cond_var.wait(lock);
+                continue;
+            }
+
+            auto next_tick = boost::get_system_time() + poll_interval;
+            while (!stopping && !woken && boost::get_system_time() < next_tick) {
+                cond_var.timed_wait(lock, next_tick);
+            }
+            if (stopping) {
+                break;
+            }
+            woken = false;
+
+            // watchers added during the check wait for the next tick,
+            // after the ones that are already waiting
+            std::list<watcher> waiting;
+            waiting.swap(watchers);
+            lock.unlock();
+            check(waiting);
+            lock.lock();
+            watchers.splice(watchers.begin(), waiting);
+        }
+    }
+
+    void
+    check(std::list<watcher> &waiting)
+    {
+        core::kernel::device_enumeration_type devices;
+        std::exception_ptr eptr;
+
+        try {
+            devices = kernel.enumerate_devices();
+        }
+        catch (...) {
+            eptr = std::current_exception();
+        }
+
+        for (auto it = waiting.begin(); it != waiting.end(); ) {
+            bool done;
+            try {
+                done = (*it)(devices, eptr);
+            }
+            catch (std::exception const &e) {
+                CLOG(ERROR, "core.kernel") << "device watcher failed: " << e.what();
+                done = true;
+            }
+            it = done ? waiting.erase(it) : std::next(it);
+        }
+    }
+};
+
 /**
  * Request handlers
  */
 
+// hex-encoded firmware in JSON is the biggest message
+static const std::size_t websocket_max_message_size = 4 * 1024 * 1024;
+
+// every websocket holds a thread, idle ones are closed
+static const int websocket_max_connections = 16;
+static const int websocket_idle_timeout = 300;
+
 struct handler
 {
     std::unique_ptr<core::kernel> kernel;
+    http_server::tls_statistics const *tls_stats;
+
+    handler(std::unique_ptr<core::kernel> k,
+            http_server::tls_statistics const *stats)
+        : kernel{std::move(k)},
+          tls_stats{stats},
+          watch{*kernel}
+    { }
+
+    ~handler()
+    {
+        stop();
+    }
+
+    // has to run before the server lets go of its requests: watchers and
+    // websockets still refer to them
+    void
+    stop()
+    {
+        watch.stop();
+        close_websockets();
+    }
+
+    // wakes up the websocket threads and waits until they are done with
+    // the handler, no websocket is accepted afterwards
+    void
+    close_websockets()
+    {
+        boost::unique_lock<boost::mutex> lock{websockets_mutex};
+        websockets_closed = true;
+        for (auto socket: websocket_sockets) {
+            websocket::shutdown_socket(socket);
+        }
+        while (websocket_threads > 0) {
+            websockets_done.wait(lock);
+        }
+    }
 
     bool
     is_origin_allowed(std::string const &origin)
@@ -189,15 +591,23 @@ struct handler
             Json::Value nil;
 
             auto version = kernel->get_version();
-            auto configured = kernel->has_config();
-            auto valid_until = kernel->get_config().c.has_valid_until()
-                ? kernel->get_config().c.valid_until()
+            auto config = kernel->get_config();
+            auto configured = config->is_initialized();
+            auto valid_until = config->c.has_valid_until()
+                ? config->c.valid_until()
                 : nil;
 
+            Json::Value tls_sessions{Json::objectValue};
+            if (tls_stats) {
+                tls_sessions["handshakes"] = Json::UInt64(tls_stats->handshakes);
+                tls_sessions["resumed"] = Json::UInt64(tls_stats->resumed);
+            }
+
             return json_response(200, {
                     {"version", version},
                     {"configured", configured},
-                    {"validUntil", valid_until}
+                    {"validUntil", valid_until},
+                    {"tlsSessions", tls_sessions}
                 });
         }
         catch (...) {
@@ -209,13 +619,27 @@ struct handler
     handle_configure(http_server::request_data const &request)
     {
         try {
-            auto body = request.body.str();
+            auto const &body = request.body;
             auto origin = request.get_header("Origin");
+            auto signed_config = utils::hex_decode(body);
+
+            // wallets post the same config on every page load, skip the
+            // signature check and the schema rebuild for the active one
+            auto active = kernel->get_snapshot();
+            if (active->config.is_parsed_from(signed_config)) {
+                if (!active->config.is_unexpired()) {
+                    throw response_error{400, "configuration is expired"};
+                }
+                if (origin && !active->is_url_allowed(origin)) {
+                    throw response_error{400, "origin not allowed"};
+                }
+                return json_response(200, {});
+            }
 
             core::kernel_config config;
 
             try {
-                config.parse_from_signed_string(utils::hex_decode(body));
+                config.parse_from_signed_string(signed_config);
                 LOG(INFO)
                     << "parsed configuration: \n"
                     << config.get_debug_string();
@@ -245,27 +669,46 @@ struct handler
     http_server::response_data
     handle_listen(http_server::request_data const &request)
     {
-        static const auto iter_max = 60;
-        static const auto iter_delay = boost::posix_time::milliseconds(500);
+        // clients ask again after this long without a change
+        static const auto max_wait = boost::posix_time::seconds(30);
 
         try {
-            auto body = request.body.str();
+            auto current = kernel->enumerate_devices();
+            auto devices = current;
+            bool compare_serials = true;
 
-            auto devices = body.empty() ? kernel->enumerate_devices() : json_to_devices(body);
+            if (!request.body.empty()) {
+                auto json = request_body_to_json(request);
+                devices = json_to_devices(json);
+                compare_serials = lists_serials(json);
+            }
 
-            for (int i = 0; i < iter_max; i++) {
-                auto updated_devices = kernel->enumerate_devices();
+            // what the client would see of an enumeration
+            auto as_known = [compare_serials] (core::kernel::device_enumeration_type const &d) {
+                return compare_serials ? d : without_serials(d);
+            };
 
-                if (updated_devices == devices) {
-                    boost::this_thread::sleep(iter_delay);
-                }
-                else {
-                    devices = updated_devices;
-                    break;
-                }
+            if (as_known(current) != devices) {
+                return negotiated_response(request, 200, devices_to_json(current));
             }
 
-            return json_response(200, devices_to_json(devices));
+            auto deadline = boost::get_system_time() + max_wait;
+            auto complete = request.complete;
+
+            watch.add([=, &request] (core::kernel::device_enumeration_type const &updated,
+                                     std::exception_ptr eptr) {
+                    if (eptr) {
+                        complete(json_error_response(eptr));
+                        return true;
+                    }
+                    if (as_known(updated) == devices && boost::get_system_time() < deadline) {
+                        return false;
+                    }
+                    complete(negotiated_response(request, 200, devices_to_json(updated)));
+                    return true;
+                });
+
+            return http_server::response_data::deferred();
         }
         catch (...) {
             return json_error_response(std::current_exception());
@@ -277,7 +720,7 @@ struct handler
     {
         try {
             auto devices = kernel->enumerate_devices();
-            return json_response(200, devices_to_json(devices));
+            return negotiated_response(request, 200, devices_to_json(devices));
         }
         catch (...) {
             return json_error_response(std::current_exception());
@@ -288,15 +731,99 @@ struct handler
     handle_acquire(http_server::request_data const &request)
     {
         try {
-            auto device_path = decode_device_path(request.url_params.str(1));
+            auto device_path = request.url_params.has("serial")
+                ? find_device_path_by_serial(request.url_params.get("serial"))
+                : decode_device_path(request.url_params.get("path"));
 
             // slight hack to keep the types correct
-            auto check_previous = request.url_params.size() > 2;
-            auto previous_or_null = check_previous ? request.url_params.str(2) : "null";
+            auto check_previous = request.url_params.has("previous");
+            auto previous_or_null = check_previous ? request.url_params.get("previous") : "null";
             auto previous = previous_or_null == "null" ? "" : previous_or_null;
 
             auto session_id = kernel->open_and_acquire_session(device_path, previous, check_previous);
-            return json_response(200, {{"session", session_id}});
+            return negotiated_response(request, 200, {
+                    {"path", encode_device_path(device_path)},
+                    {"session", session_id}
+                });
+        }
+        catch (...) {
+            return json_error_response(std::current_exception());
+        }
+    }
+
+    http_server::response_data
+    handle_acquire_any(http_server::request_data const &request)
+    {
+        // same limit as /listen
+        static const unsigned int max_wait = 30;
+
+        try {
+            auto json = request_body_to_json(request);
+            if (!json.isNull() && !json.isObject()) {
+                throw response_error{400, "expecting JSON object"};
+            }
+
+            auto const &serial = json["serial"];
+            if (!serial.isNull() && !serial.isString()) {
+                throw response_error{400, "invalid serial"};
+            }
+
+            core::kernel::device_filter filter;
+            filter.vendor_id = json_uint(json, "vendor", 0xFFFF);
+            filter.product_id = json_uint(json, "product", 0xFFFF);
+            filter.serial_number = serial.asString();
+
+            auto wait = std::min(json_uint(json, "wait", UINT_MAX), max_wait);
+
+            auto respond = [&request] (acquired_device const &acquired) {
+                return negotiated_response(request, 200, {
+                        {"path", encode_device_path(acquired.first.path)},
+                        {"session", acquired.second}
+                    });
+            };
+
+            // clients already waiting get devices first
+            if (acquire_waiters == 0) {
+                acquired_device acquired;
+                auto devices = kernel->enumerate_devices();
+                if (kernel->acquire_free_device(filter, devices, acquired)) {
+                    return respond(acquired);
+                }
+                if (wait == 0) {
+                    throw response_error{404, "no free device"};
+                }
+            }
+
+            // checked with every tick of the device watch, in order
+            auto deadline = boost::get_system_time() + boost::posix_time::seconds(wait);
+            auto complete = request.complete;
+
+            acquire_waiters++;
+            watch.add([=] (core::kernel::device_enumeration_type const &devices,
+                           std::exception_ptr eptr) {
+                    try {
+                        if (eptr) {
+                            std::rethrow_exception(eptr);
+                        }
+                        acquired_device acquired;
+                        if (kernel->acquire_free_device(filter, devices, acquired)) {
+                            complete(respond(acquired));
+                        }
+                        else if (boost::get_system_time() >= deadline) {
+                            complete(json_response(404, {{"error", "no free device"}}));
+                        }
+                        else {
+                            return false;
+                        }
+                    }
+                    catch (...) {
+                        complete(json_error_response(std::current_exception()));
+                    }
+                    acquire_waiters--;
+                    return true;
+                });
+
+            return http_server::response_data::deferred();
         }
         catch (...) {
             return json_error_response(std::current_exception());
@@ -307,13 +834,15 @@ struct handler
     handle_release(http_server::request_data const &request)
     {
         try {
-            auto session_id = request.url_params.str(1);
+            auto session_id = request.url_params.get("session");
             try {
                 kernel->close_and_release_session(session_id);
             }
             catch (core::kernel::unknown_session const &e) {
                 throw response_error{404, e.what()};
             }
+            // listeners see the session go right away
+            watch.wake();
             return json_response(200, {});
         }
         catch (...) {
@@ -325,34 +854,630 @@ struct handler
     handle_call(http_server::request_data const &request)
     {
         try {
-            auto session_id = request.url_params.str(1);
-            auto body = request.body.str();
+            auto session_id = request.url_params.get("session");
+
+            wire::message wire_in;
+
+            auto device = get_device_kernel(session_id);
 
-            Json::Value json_message;
-            Json::Reader json_reader;
-            json_reader.parse(body, json_message);
+            // decode the response with the same configuration, even if
+            // the bridge gets reconfigured in the meantime
+            auto schema = kernel->get_snapshot()->schema;
 
+            // button requests answered on the bridge, if asked for
+            auto buttons = std::make_shared<std::vector<wire::message>>();
+            auto acking = is_button_ack_requested(request);
+            core::device_kernel::reply_function reply;
+            if (acking) {
+                reply = button_ack_reply(*schema, buttons);
+            }
+
+            if (is_binary_request(request)) {
+                // native protobuf clients, skip the codecs entirely
+                auto framed = is_framed_request(request);
+                binary_to_wire(request, wire_in);
+                return call_device_async(request, device, wire_in, reply,
+                    [=] (wire::message const &wire_out) {
+                        auto response = binary_response(200, wire_out, framed);
+                        if (acking) {
+                            add_button_requests_header(response, *buttons);
+                        }
+                        return response;
+                    });
+            }
+
+            auto encoding = request_bytes_encoding(request);
+
+            if (is_cbor_request(request)) {
+                schema->cbor_to_wire(request.body, wire_in);
+            }
+            else {
+                schema->json_to_wire(request_body_to_json(request), wire_in, encoding);
+            }
+
+            return call_device_async(request, device, wire_in, reply,
+                [&request, schema, buttons, acking] (wire::message const &wire_out) {
+                    if (!acking) {
+                        return wire_response(request, *schema, wire_out);
+                    }
+                    auto response = wire_response(request, *schema, wire_out, buttons.get());
+                    add_button_requests_header(response, *buttons);
+                    return response;
+                });
+        }
+        catch (...) {
+            return json_error_response(std::current_exception());
+        }
+    }
+
+    http_server::response_data
+    handle_call_batch(http_server::request_data const &request)
+    {
+        try {
+            auto session_id = request.url_params.get("session");
+            auto encoding = request_bytes_encoding(request);
+            auto batch = request_body_to_json(request);
+
+            if (!batch.isArray()) {
+                throw response_error{400, "expecting array of messages"};
+            }
+
+            auto state = std::make_shared<call_batch_state>();
+            state->device = get_device_kernel(session_id);
+            state->schema = kernel->get_snapshot()->schema;
+            state->encoding = encoding;
+
+            // everything is converted up front, the device does not wait
+            // for JSON between the calls; a malformed message ends the
+            // batch there
+            for (auto const &item: batch) {
+                wire::message wire_in;
+                try {
+                    state->schema->json_to_wire(item, wire_in, encoding);
+                }
+                catch (std::exception const &e) {
+                    state->conversion_error = e.what();
+                    break;
+                }
+                state->messages.push_back(std::move(wire_in));
+                state->expected.push_back(item["expected"]);
+            }
+
+            if (state->messages.empty()) {
+                if (!state->conversion_error.empty()) {
+                    state->responses.append(json_value({{"error", state->conversion_error}}));
+                }
+                return negotiated_response(request, 200, state->responses);
+            }
+
+            auto complete = request.complete;
+            state->finish = [complete, &request] (Json::Value const &responses) {
+                try {
+                    complete(negotiated_response(request, 200, responses));
+                }
+                catch (...) {
+                    complete(json_error_response(std::current_exception()));
+                }
+            };
+
+            call_batch_next(state);
+            return http_server::response_data::deferred();
+        }
+        catch (...) {
+            return json_error_response(std::current_exception());
+        }
+    }
+
+    http_server::response_data
+    handle_call_many(http_server::request_data const &request)
+    {
+        try {
+            auto encoding = request_bytes_encoding(request);
+            auto body = request_body_to_json(request);
+            auto const &sessions = body["sessions"];
+
+            if (!sessions.isArray()) {
+                throw response_error{400, "expecting array of sessions"};
+            }
+
+            auto schema = kernel->get_snapshot()->schema;
+
+            // converted once, shared by all the devices
+            wire::message wire_in;
+            schema->json_to_wire(body["message"], wire_in, encoding);
+
+            auto state = std::make_shared<call_many_state>();
+            std::vector<std::pair<std::string, core::device_kernel *>> calls;
+
+            for (auto const &item: sessions) {
+                auto session_id = item.asString();
+                try {
+                    auto device = kernel->get_device_kernel_by_session_id(session_id);
+                    calls.emplace_back(session_id, device);
+                }
+                catch (core::kernel::unknown_session const &e) {
+                    state->responses[session_id] = json_value({{"error", e.what()}});
+                }
+            }
+
+            if (calls.empty()) {
+                return negotiated_response(request, 200, state->responses);
+            }
+            state->pending = calls.size();
+
+            // every device answers on its own executor, the last one to
+            // finish completes the request
+            auto complete = request.complete;
+
+            for (auto const &call: calls) {
+                auto session_id = call.first;
+                kernel->call_device_async(call.second, wire_in,
+                    [=, &request] (std::exception_ptr eptr, wire::message const &wire_out) {
+                        Json::Value json_out;
+                        try {
+                            if (eptr) {
+                                std::rethrow_exception(eptr);
+                            }
+                            schema->wire_to_json(wire_out, json_out, encoding);
+                        }
+                        catch (std::exception const &e) {
+                            json_out = json_value({{"error", e.what()}});
+                        }
+
+                        boost::unique_lock<boost::mutex> lock{state->mutex};
+                        state->responses[session_id] = json_out;
+                        if (--state->pending == 0) {
+                            lock.unlock();
+                            complete(negotiated_response(request, 200, state->responses));
+                        }
+                    });
+            }
+
+            return http_server::response_data::deferred();
+        }
+        catch (...) {
+            return json_error_response(std::current_exception());
+        }
+    }
+
+    http_server::response_data
+    handle_sign_tx(http_server::request_data const &request)
+    {
+        try {
+            auto session_id = request.url_params.get("session");
+            auto encoding = request_bytes_encoding(request);
+            auto body = request_body_to_json(request);
+
+            auto device = get_device_kernel(session_id);
+            auto schema = kernel->get_snapshot()->schema;
+
+            // the message starting the flow, usually SignTx
             wire::message wire_in;
-            wire::message wire_out;
+            schema->json_to_wire(body["message"], wire_in, encoding);
 
-            core::device_kernel *device;
+            std::shared_ptr<signing::tx_driver> driver;
             try {
-                device = kernel->get_device_kernel_by_session_id(session_id);
+                driver = std::make_shared<signing::tx_driver>(*schema, body, encoding);
             }
-            catch (core::kernel::unknown_session const &e) {
-                throw response_error{404, e.what()};
+            catch (signing::tx_driver::invalid_transaction const &e) {
+                throw response_error{400, e.what()};
             }
 
-            kernel->json_to_wire(json_message, wire_in);
-            kernel->call_device(device, wire_in, wire_out);
-            kernel->wire_to_json(wire_out, json_message);
+            return call_device_async(request, device, wire_in,
+                [driver] (wire::message const &wire_out, wire::message &wire_reply) {
+                    return driver->reply(wire_out, wire_reply);
+                },
+                [&request, schema, driver] (wire::message const &wire_out) {
+                    if (driver->is_failed()) {
+                        // cancelled on the device already
+                        throw response_error{400, driver->failure_reason().c_str()};
+                    }
+                    if (driver->is_finished()) {
+                        return negotiated_response(request, 200, driver->result());
+                    }
+                    // the device left the flow, e.g. with a Failure
+                    return wire_response(request, *schema, wire_out);
+                });
+        }
+        catch (...) {
+            return json_error_response(std::current_exception());
+        }
+    }
+
+    http_server::response_data
+    handle_websocket(http_server::request_data const &request)
+    {
+        try {
+            auto session_id = request.url_params.get("session");
+            auto upgrade = request.get_header("Upgrade");
+            auto key = request.get_header("Sec-WebSocket-Key");
+
+            if (!upgrade || !boost::iequals(upgrade, "websocket") || !key) {
+                throw response_error{400, "websocket upgrade expected"};
+            }
+
+            auto version = request.get_header("Sec-WebSocket-Version");
+            if (!version || std::strcmp(version, "13") != 0) {
+                auto response = json_response(426, {{"error", "unsupported websocket version"}});
+                response.add_header("Sec-WebSocket-Version", "13");
+                return response;
+            }
+
+            {
+                boost::unique_lock<boost::mutex> lock{websockets_mutex};
+                if (websocket_threads >= websocket_max_connections) {
+                    throw response_error{503, "too many websockets"};
+                }
+            }
+
+            get_device_kernel(session_id); // fail early on unknown session
+            auto encoding = request_bytes_encoding(request);
 
-            return json_response(200, json_message);
+            auto response = http_server::response_data::upgrade(
+                [=] (http_server::upgraded_connection connection) {
+                    // the check above can race with other upgrades
+                    boost::unique_lock<boost::mutex> lock{websockets_mutex};
+                    if (websockets_closed
+                        || websocket_threads >= websocket_max_connections) {
+                        lock.unlock();
+                        connection.close();
+                        return;
+                    }
+                    websocket_threads++;
+                    websocket_sockets.insert(connection.socket);
+                    boost::thread{&handler::run_websocket, this,
+                                  session_id, encoding, connection}.detach();
+                });
+            response.add_header("Upgrade", "websocket");
+            response.add_header("Sec-WebSocket-Accept",
+                                websocket::accept_key(key).c_str());
+            return response;
         }
         catch (...) {
             return json_error_response(std::current_exception());
         }
     }
+
+    http_server::response_data
+    handle_firmware_upload(http_server::request_data const &request)
+    {
+        // firmware of any TREZOR is a fraction of this
+        static const std::size_t max_firmware_size = 16 * 1024 * 1024;
+
+        try {
+            auto session_id = request.url_params.get("session");
+            auto path = request.get_argument("path");
+            auto schema = kernel->get_snapshot()->schema;
+
+            wire::bytes_message wire_in{
+                schema->find_bytes_message_id("FirmwareUpload"),
+                reinterpret_cast<std::uint8_t const *>(request.body.data()),
+                request.body.size()
+            };
+
+            auto device = get_device_kernel(session_id);
+
+            // the bytes stay with the request or the mapped file until the
+            // device has answered
+            auto respond = [&request, schema] (wire::message const &wire_out) {
+                return wire_response(request, *schema, wire_out);
+            };
+
+            if (!path) {
+                // firmware binary is the request body itself, bounded by
+                // the body size limit of the server
+                return call_device_async(request, device, wire_in, nullptr, respond);
+            }
+
+            // files are read with the rights of the bridge, only clients
+            // allowed on the unix socket may name one
+            if (!request.local) {
+                throw response_error{403, "firmware path not allowed"};
+            }
+
+            auto firmware = std::make_shared<boost::iostreams::mapped_file_source>();
+            try {
+                firmware->open(path);
+            }
+            catch (std::exception const &e) {
+                throw response_error{400, "cannot open firmware file"};
+            }
+            if (firmware->size() > max_firmware_size) {
+                throw response_error{413, "firmware file too large"};
+            }
+
+            wire_in.bytes = reinterpret_cast<std::uint8_t const *>(firmware->data());
+            wire_in.bytes_size = firmware->size();
+
+            return call_device_async(request, device, wire_in, nullptr,
+                [firmware, respond] (wire::message const &wire_out) {
+                    return respond(wire_out);
+                });
+        }
+        catch (...) {
+            return json_error_response(std::current_exception());
+        }
+    }
+
+private:
+
+    device_watch watch;
+    std::atomic<int> acquire_waiters{0};
+
+    // each websocket is served by a detached thread, which is accounted
+    // for here until it no longer touches the handler
+    boost::mutex websockets_mutex;
+    boost::condition_variable websockets_done;
+    std::set<MHD_socket> websocket_sockets;
+    int websocket_threads = 0;
+    bool websockets_closed = false;
+
+    using acquired_device = std::pair<
+        wire::device_info, core::kernel::session_id_type>;
+
+    // optional unsigned field of a request body, zero when missing
+    static
+    unsigned int
+    json_uint(Json::Value const &json, char const *name, unsigned int max)
+    {
+        auto const &value = json[name];
+        if (value.isNull()) {
+            return 0;
+        }
+        if (!value.isUInt() || value.asUInt() > max) {
+            throw response_error{400, (std::string{"invalid "} + name).c_str()};
+        }
+        return value.asUInt();
+    }
+
+    // progress of a /call-batch, every response sends the next message
+    struct call_batch_state
+    {
+        core::device_kernel *device;
+        core::kernel_snapshot::schema_ptr schema;
+        protobuf::bytes_encoding encoding;
+
+        std::vector<wire::message> messages;
+        std::vector<Json::Value> expected;
+        std::string conversion_error; // of the message after the last one
+
+        Json::Value responses{Json::arrayValue};
+        std::function<void (Json::Value const &)> finish;
+    };
+
+    void
+    call_batch_next(std::shared_ptr<call_batch_state> state)
+    {
+        auto index = state->responses.size();
+
+        if (index == state->messages.size()) {
+            if (!state->conversion_error.empty()) {
+                state->responses.append(json_value({{"error", state->conversion_error}}));
+            }
+            state->finish(state->responses);
+            return;
+        }
+
+        kernel->call_device_async(state->device, state->messages[index],
+            [this, state, index] (std::exception_ptr eptr, wire::message const &wire_out) {
+                Json::Value json_out;
+                try {
+                    if (eptr) {
+                        std::rethrow_exception(eptr);
+                    }
+                    state->schema->wire_to_json(wire_out, json_out, state->encoding);
+                }
+                catch (std::exception const &e) {
+                    // the responses so far are still worth returning
+                    state->responses.append(json_value({{"error", e.what()}}));
+                    state->finish(state->responses);
+                    return;
+                }
+                state->responses.append(json_out);
+
+                auto const &expected = state->expected[index];
+                if (!expected.isNull() && expected != json_out["type"]) {
+                    // unexpected response, the rest would make no sense
+                    state->finish(state->responses);
+                    return;
+                }
+                call_batch_next(state);
+            });
+    }
+
+    // responses of a /call-many, keyed by session
+    struct call_many_state
+    {
+        boost::mutex mutex;
+        Json::Value responses{Json::objectValue};
+        std::size_t pending = 0;
+    };
+
+    using wire_responder = std::function<
+        http_server::response_data (wire::message const &)>;
+
+    template <typename message_type>
+    http_server::response_data
+    call_device_async(http_server::request_data const &request,
+                      core::device_kernel *device,
+                      message_type const &wire_in,
+                      core::device_kernel::reply_function reply,
+                      wire_responder responder)
+    {
+        // the connection waits for the device without holding a thread
+        auto complete = request.complete;
+
+        core::device_kernel::call_callback callback =
+            [=] (std::exception_ptr eptr, wire::message const &wire_out) {
+                if (eptr) {
+                    complete(json_error_response(eptr));
+                    return;
+                }
+                try {
+                    complete(responder(wire_out));
+                }
+                catch (...) {
+                    complete(json_error_response(std::current_exception()));
+                }
+            };
+
+        if (reply) {
+            kernel->call_device_async(device, wire_in, reply, callback);
+        }
+        else {
+            kernel->call_device_async(device, wire_in, callback);
+        }
+
+        return http_server::response_data::deferred();
+    }
+
+    static
+    core::device_kernel::reply_function
+    button_ack_reply(core::kernel_schema const &schema,
+                     std::shared_ptr<std::vector<wire::message>> const &buttons)
+    {
+        auto button_request_id = schema.find_message_id("ButtonRequest");
+        auto button_ack_id = schema.find_message_id("ButtonAck");
+
+        return [=] (wire::message const &wire_out, wire::message &wire_reply) {
+            if (wire_out.id != button_request_id) {
+                return false;
+            }
+            buttons->push_back(wire_out);
+            wire_reply.id = button_ack_id;
+            wire_reply.data.clear(); // ButtonAck has no fields
+            return true;
+        };
+    }
+
+    // messages are handled one at a time, like consecutive /call requests
+    void
+    run_websocket(core::kernel::session_id_type const &session_id,
+                  protobuf::bytes_encoding encoding,
+                  http_server::upgraded_connection connection)
+    {
+        websocket::connection channel{
+            connection.socket, connection.extra_in,
+            websocket_max_message_size, websocket_idle_timeout};
+
+        try {
+            websocket::opcode type;
+            std::string payload;
+
+            while (channel.read_message(type, payload)) {
+                try {
+                    auto reply = websocket_call(session_id, type, payload, encoding);
+                    channel.send(type, reply);
+                }
+                catch (std::exception const &e) {
+                    Json::Value error{Json::objectValue};
+                    error["error"] = e.what();
+                    channel.send(websocket::opcode::text, error.toStyledString());
+                }
+            }
+        }
+        catch (std::exception const &e) {
+            LOG(INFO) << "closing websocket: " << e.what();
+        }
+
+        // the socket is only shut down by close_websockets while it is
+        // still open
+        {
+            boost::unique_lock<boost::mutex> lock{websockets_mutex};
+            websocket_sockets.erase(connection.socket);
+        }
+        connection.close();
+
+        boost::unique_lock<boost::mutex> lock{websockets_mutex};
+        websocket_threads--;
+        websockets_done.notify_all();
+    }
+
+    std::string
+    websocket_call(core::kernel::session_id_type const &session_id,
+                   websocket::opcode type,
+                   std::string const &payload,
+                   protobuf::bytes_encoding encoding)
+    {
+        // resolved for every message, so releasing the session ends it
+        auto device = get_device_kernel(session_id);
+
+        wire::message wire_in;
+        wire::message wire_out;
+
+        if (type == websocket::opcode::binary) {
+            wire_in.read_from_frame(
+                reinterpret_cast<std::uint8_t const *>(payload.data()),
+                payload.size());
+            kernel->call_device(device, wire_in, wire_out);
+
+            std::vector<std::uint8_t> frame;
+            wire_out.write_to_frame(frame);
+            return std::string{frame.begin(), frame.end()};
+        }
+
+        auto schema = kernel->get_snapshot()->schema;
+
+        Json::Value json;
+        Json::Reader json_reader;
+        json_reader.parse(payload, json);
+
+        schema->json_to_wire(json, wire_in, encoding);
+        kernel->call_device(device, wire_in, wire_out);
+        schema->wire_to_json(wire_out, json, encoding);
+        return json.toStyledString();
+    }
+
+    core::kernel::device_path_type
+    find_device_path_by_serial(std::string const &serial_number)
+    {
+        try {
+            return kernel->find_device_path_by_serial(serial_number);
+        }
+        catch (core::kernel::unknown_device const &e) {
+            throw response_error{404, e.what()};
+        }
+    }
+
+    core::device_kernel *
+    get_device_kernel(core::kernel::session_id_type const &session_id)
+    {
+        try {
+            return kernel->get_device_kernel_by_session_id(session_id);
+        }
+        catch (core::kernel::unknown_session const &e) {
+            throw response_error{404, e.what()};
+        }
+    }
+
+    static
+    http_server::response_data
+    wire_response(http_server::request_data const &request,
+                  core::kernel_schema const &schema,
+                  wire::message const &wire,
+                  std::vector<wire::message> const *buttons = nullptr)
+    {
+        if (is_cbor_accepted(request)) {
+            std::string cbor_message;
+            schema.wire_to_cbor(wire, cbor_message);
+            return cbor_response(200, cbor_message);
+        }
+
+        auto encoding = request_bytes_encoding(request);
+        Json::Value json_message;
+        schema.wire_to_json(wire, json_message, encoding);
+
+        if (buttons) {
+            Json::Value json_buttons{Json::arrayValue};
+            for (auto const &button: *buttons) {
+                Json::Value json_button;
+                schema.wire_to_json(button, json_button, encoding);
+                json_buttons.append(json_button);
+            }
+            json_message["buttonRequests"] = json_buttons;
+        }
+        return json_response(200, json_message);
+    }
 };
 
 }
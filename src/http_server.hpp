@@ -18,12 +18,23 @@
  */
 
 #include <microhttpd.h>
+#include <gnutls/gnutls.h>
+
+#include <atomic>
+#include <future>
+#include <map>
+
+#include <boost/lexical_cast.hpp>
 
 #ifdef _WIN32
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #else
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 #endif
 
 namespace trezord
@@ -31,13 +42,77 @@ namespace trezord
 namespace http_server
 {
 
+struct response_data;
+
+// path parameters of the matched route, by name
+struct path_params
+{
+    std::vector<std::pair<std::string, std::string>> values;
+
+    bool
+    has(char const *name) const
+    {
+        return find(name) != nullptr;
+    }
+
+    std::string
+    get(char const *name) const
+    {
+        auto value = find(name);
+        return value ? *value : std::string();
+    }
+
+    void
+    push(std::string const &name, std::string const &value)
+    {
+        values.emplace_back(name, value);
+    }
+
+    void
+    pop()
+    {
+        values.pop_back();
+    }
+
+    void
+    clear()
+    {
+        values.clear();
+    }
+
+private:
+
+    std::string const *
+    find(char const *name) const
+    {
+        for (auto const &v : values) {
+            if (v.first == name) {
+                return &v.second;
+            }
+        }
+        return nullptr;
+    }
+};
+
 struct request_data
 {
     MHD_Connection *connection;
     std::string url;
     std::string method;
-    std::stringstream body;
-    boost::smatch url_params;
+    std::string body;
+    path_params url_params;
+    bool body_too_large;
+
+    // received on the unix socket, whose file permissions already
+    // decided who may connect
+    bool local;
+
+    // response of a handler that ran while the connection was suspended
+    std::unique_ptr<response_data> response;
+
+    // handlers answering asynchronously return response_data::deferred()
+    // and pass the actual response here once it is ready
+    std::function<void (response_data)> complete;
 
     char const *
     get_header(char const *name) const
@@ -45,8 +120,32 @@ struct request_data
         return MHD_lookup_connection_value(
             connection, MHD_HEADER_KIND, name);
     }
+
+    char const *
+    get_argument(char const *name) const
+    {
+        return MHD_lookup_connection_value(
+            connection, MHD_GET_ARGUMENT_KIND, name);
+    }
 };
 
+// connection taken over by a handler after 101 Switching Protocols,
+// handed back to the server with close()
+struct upgraded_connection
+{
+    MHD_socket socket;
+    std::string extra_in; // data received right after the request
+    MHD_UpgradeResponseHandle *handle;
+
+    void
+    close()
+    {
+        MHD_upgrade_action(handle, MHD_UPGRADE_ACTION_CLOSE);
+    }
+};
+
+using upgrade_handler = std::function<void (upgraded_connection)>;
+
 struct response_data
 {
     using ptr = std::unique_ptr<
@@ -57,7 +156,7 @@ struct response_data
 
     response_data(int status, std::string const &body)
         : status_code{status},
-          response{mhd_response_from_string(body.c_str()), &MHD_destroy_response}
+          response{mhd_response_from_buffer(body.data(), body.size()), &MHD_destroy_response}
     { }
 
     response_data(int status, char const *body)
@@ -65,10 +164,33 @@ struct response_data
           response{mhd_response_from_string(body), &MHD_destroy_response}
     { }
 
+    static
+    response_data
+    deferred()
+    {
+        return response_data{};
+    }
+
+    // the handler runs in a server thread and must not block
+    static
+    response_data
+    upgrade(upgrade_handler handler)
+    {
+        auto cls = new upgrade_handler{std::move(handler)};
+        return response_data{
+            101, MHD_create_response_for_upgrade(&response_data::upgrade_callback, cls)};
+    }
+
+    bool
+    is_deferred() const
+    {
+        return !response;
+    }
+
     int
     add_header(char const *name, char const *value)
     {
-        if (name && value) {
+        if (response && name && value) {
             return MHD_add_response_header(response.get(), name, value);
         }
         else {
@@ -90,9 +212,44 @@ struct response_data
 
 private:
 
+    response_data()
+        : status_code{0},
+          response{nullptr, &MHD_destroy_response}
+    { }
+
+    response_data(int status, MHD_Response *r)
+        : status_code{status},
+          response{r, &MHD_destroy_response}
+    { }
+
+    static
+    void
+    upgrade_callback(void *cls,
+                     MHD_Connection *connection,
+                     void *con_cls,
+                     char const *extra_in,
+                     std::size_t extra_in_size,
+                     MHD_socket sock,
+                     MHD_UpgradeResponseHandle *urh)
+    {
+        std::unique_ptr<upgrade_handler> handler{
+            static_cast<upgrade_handler *>(cls)};
+        std::string extra = extra_in
+            ? std::string{extra_in, extra_in_size}
+            : std::string{};
+        (*handler)(upgraded_connection{sock, extra, urh});
+    }
+
     static
     MHD_Response *
     mhd_response_from_string(char const *body)
+    {
+        return mhd_response_from_buffer(body, std::strlen(body));
+    }
+
+    static
+    MHD_Response *
+    mhd_response_from_buffer(char const *body, std::size_t size)
     {
         // MHD_create_response_from_buffer has many modes of operation,
         // but the buffer for MHD_RESPMEM_MUST_COPY mode is effectively
@@ -100,38 +257,257 @@ private:
         auto body_buffer = static_cast<void *>(const_cast<char *>(body));
 
         return MHD_create_response_from_buffer(
-            std::strlen(body), body_buffer, MHD_RESPMEM_MUST_COPY);
+            size, body_buffer, MHD_RESPMEM_MUST_COPY);
     }
 };
 
 using request_handler = std::function<response_data (request_data const &)>;
 
-struct regex_route
+/**
+ * Route patterns are made of literal path segments, `:name` segments
+ * matching one non-empty segment, and a trailing `*name` segment
+ * matching the non-empty rest of the path.  Method `*` matches any
+ * method, pattern `*` matches any url and is used as a fallback.
+ */
+
+struct route
 {
-    boost::regex method;
-    boost::regex url;
+    std::string method;
+    std::string pattern;
+};
 
-    regex_route(char const *method_pattern,
-                char const *url_pattern)
-        : method{method_pattern},
-          url{url_pattern}
-    { }
+using route_entry = std::pair<route, request_handler>;
+using route_table = std::vector<route_entry>;
+using cors_validator = std::function<bool(char const *)>;
 
-    bool
-    match_request(request_data *request) const
+struct router
+{
+    explicit router(route_table const &table)
     {
-        return (boost::regex_match(request->method, method))
-            && (boost::regex_match(request->url, request->url_params, url));
+        for (auto const &r : table) {
+            add_route(r.first, &r.second);
+        }
+    }
+
+    // matched handler is owned by the route table, params of the
+    // matched route are stored in request->url_params
+    request_handler const *
+    match(request_data *request) const
+    {
+        auto it = methods.find(request->method);
+        if (it != methods.end()) {
+            auto handler = match_url(it->second, request);
+            if (handler) {
+                return handler;
+            }
+        }
+
+        auto handler = match_url(any_method, request);
+        if (handler) {
+            return handler;
+        }
+
+        it = method_fallbacks.find(request->method);
+        if (it != method_fallbacks.end()) {
+            return it->second.handler;
+        }
+        return any_method_fallback;
+    }
+
+private:
+
+    struct node
+    {
+        std::vector<std::pair<std::string, std::unique_ptr<node>>> literals;
+        std::unique_ptr<node> param;
+        std::string param_name;
+        std::string tail_name;
+        request_handler const *handler = nullptr;
+        request_handler const *tail_handler = nullptr;
+    };
+
+    std::map<std::string, node> methods;
+    std::map<std::string, node> method_fallbacks;
+    node any_method;
+    request_handler const *any_method_fallback = nullptr;
+
+    void
+    add_route(route const &r, request_handler const *handler)
+    {
+        if (r.pattern == "*") {
+            if (r.method == "*") {
+                set_handler(any_method_fallback, handler, r);
+            }
+            else {
+                set_handler(method_fallbacks[r.method].handler, handler, r);
+            }
+            return;
+        }
+
+        if (r.pattern.empty() || r.pattern[0] != '/') {
+            throw std::invalid_argument{"route pattern must start with /: " + r.pattern};
+        }
+
+        node *n = (r.method == "*") ? &any_method : &methods[r.method];
+
+        auto segments = split_pattern(r.pattern);
+        for (std::size_t i = 0; i < segments.size(); i++) {
+            auto const &segment = segments[i];
+
+            if (segment.size() > 1 && segment[0] == '*') {
+                if (i != segments.size() - 1) {
+                    throw std::invalid_argument{"tail segment must be last: " + r.pattern};
+                }
+                set_param_name(n->tail_name, segment.substr(1), r);
+                set_handler(n->tail_handler, handler, r);
+                return;
+            }
+            else if (segment.size() > 1 && segment[0] == ':') {
+                if (!n->param) {
+                    n->param.reset(new node);
+                }
+                set_param_name(n->param_name, segment.substr(1), r);
+                n = n->param.get();
+            }
+            else {
+                n = &literal_child(*n, segment);
+            }
+        }
+
+        set_handler(n->handler, handler, r);
+    }
+
+    static
+    std::vector<std::string>
+    split_pattern(std::string const &pattern)
+    {
+        std::vector<std::string> segments;
+        if (pattern == "/") {
+            return segments;
+        }
+
+        std::size_t begin = 1;
+        for (;;) {
+            auto end = pattern.find('/', begin);
+            auto segment = pattern.substr(begin, end - begin);
+            if (segment.empty()) {
+                throw std::invalid_argument{"empty route segment: " + pattern};
+            }
+            segments.push_back(segment);
+            if (end == std::string::npos) {
+                return segments;
+            }
+            begin = end + 1;
+        }
+    }
+
+    static
+    node &
+    literal_child(node &n, std::string const &segment)
+    {
+        for (auto &child : n.literals) {
+            if (child.first == segment) {
+                return *child.second;
+            }
+        }
+        n.literals.emplace_back(segment, std::unique_ptr<node>{new node});
+        return *n.literals.back().second;
+    }
+
+    static
+    void
+    set_handler(request_handler const *&slot,
+                request_handler const *handler,
+                route const &r)
+    {
+        if (slot) {
+            throw std::invalid_argument{"duplicate route: " + r.method + " " + r.pattern};
+        }
+        slot = handler;
+    }
+
+    static
+    void
+    set_param_name(std::string &slot,
+                   std::string const &name,
+                   route const &r)
+    {
+        if (!slot.empty() && slot != name) {
+            throw std::invalid_argument{"conflicting parameter name: " + r.pattern};
+        }
+        slot = name;
+    }
+
+    static
+    request_handler const *
+    match_url(node const &root, request_data *request)
+    {
+        auto const &url = request->url;
+        auto &params = request->url_params;
+
+        params.clear();
+        if (url.empty() || url[0] != '/') {
+            return nullptr;
+        }
+        // "/" has no segments, everything else starts with one
+        return match_node(root, url, url.size() == 1 ? 1 : 0, params);
+    }
+
+    // pos points either to the end of the url or to the '/' in front of
+    // the next segment; literal children are preferred over parameters,
+    // parameters over the tail
+    static
+    request_handler const *
+    match_node(node const &n,
+               std::string const &url,
+               std::size_t pos,
+               path_params &params)
+    {
+        if (pos == url.size()) {
+            return n.handler;
+        }
+
+        auto begin = pos + 1;
+        auto end = url.find('/', begin);
+        if (end == std::string::npos) {
+            end = url.size();
+        }
+        auto size = end - begin;
+
+        for (auto const &child : n.literals) {
+            if (child.first.size() == size &&
+                url.compare(begin, size, child.first) == 0) {
+                auto handler = match_node(*child.second, url, end, params);
+                if (handler) {
+                    return handler;
+                }
+            }
+        }
+
+        if (n.param && size > 0) {
+            params.push(n.param_name, url.substr(begin, size));
+            auto handler = match_node(*n.param, url, end, params);
+            if (handler) {
+                return handler;
+            }
+            params.pop();
+        }
+
+        if (n.tail_handler && begin < url.size()) {
+            params.push(n.tail_name, url.substr(begin));
+            return n.tail_handler;
+        }
+
+        return nullptr;
     }
 };
 
-using route_entry = std::pair<regex_route, request_handler>;
-using route_table = std::vector<route_entry>;
-using cors_validator = std::function<bool(char const *)>;
+// most browsers cap the pre-flight cache at 10 minutes anyway
+static const auto preflight_max_age = "600";
 
 response_data
-handle_cors_and_delegate(cors_validator validator,
-                         request_handler handler,
+handle_cors_and_delegate(cors_validator const &validator,
+                         request_handler const &handler,
                          request_data const &request)
 {
     auto origin = request.get_header("Origin");
@@ -155,6 +531,9 @@ handle_cors_and_delegate(cors_validator validator,
         response.add_header("Access-Control-Allow-Methods", req_method);
         response.add_header("Access-Control-Allow-Headers", req_headers);
         response.add_header("Access-Control-Allow-Origin", origin);
+        // let the browser skip pre-flights for a while, actual requests
+        // are still checked against the current configuration
+        response.add_header("Access-Control-Max-Age", preflight_max_age);
         return response;
     }
     else {
@@ -165,14 +544,45 @@ handle_cors_and_delegate(cors_validator validator,
     }
 }
 
+struct tls_statistics
+{
+    std::atomic<unsigned long> handshakes{0};
+    std::atomic<unsigned long> resumed{0};
+};
+
+struct server_config
+{
+    std::size_t max_body_size;
+
+    // 0 runs a thread per connection, otherwise a fixed pool of polling
+    // threads with handlers running on a separate pool of worker threads
+    unsigned int thread_pool_size;
+    unsigned int handler_threads;
+
+    // already listening socket to use instead of binding one, -1 if none
+    int listen_socket;
+
+    // counts full and resumed tls sessions, optional
+    tls_statistics *tls_stats;
+
+    // called first thing on stop, while requests are still alive, so
+    // handlers can let go of them; optional
+    std::function<void ()> before_stop;
+};
+
 struct server
 {
-    route_table const &routes;
+    router routes;
     cors_validator validator;
+    server_config config;
 
-    server(route_table const &table, cors_validator cors)
-        : routes(table),
-          validator{cors}
+    // handlers are referenced, the table has to outlive the server
+    server(route_table const &table,
+           cors_validator cors,
+           server_config const &cfg)
+        : routes{table},
+          validator{cors},
+          config(cfg)
     { }
 
     ~server() { stop(); }
@@ -189,22 +599,26 @@ struct server
         addr.sin_port = htons(port);
         inet_pton(AF_INET, address, &addr.sin_addr);
 
-        MHD_set_panic_func(&server::panic_callback, this);
+        // clients open many short connections, let them resume sessions
+        // with tickets instead of doing a full handshake every time
+        if (gnutls_session_ticket_key_generate(&ticket_key) != GNUTLS_E_SUCCESS) {
+            throw std::runtime_error{"failed to generate session ticket key"};
+        }
 
-        daemon = MHD_start_daemon(
-            MHD_USE_THREAD_PER_CONNECTION | MHD_USE_SSL,
-            port,
-            nullptr, nullptr,
-            &server::request_callback, this,
-            MHD_OPTION_SOCK_ADDR, &addr,
-            MHD_OPTION_HTTPS_MEM_KEY, key,
-            MHD_OPTION_HTTPS_MEM_CERT, cert,
-            MHD_OPTION_NOTIFY_COMPLETED, &server::completed_callback, this,
-            MHD_OPTION_EXTERNAL_LOGGER, &server::log_callback, this,
-            MHD_OPTION_CONNECTION_TIMEOUT, 0,
-            MHD_OPTION_END);
+        daemon = start_daemon(MHD_USE_SSL, port, {
+                config.listen_socket >= 0
+                    ? option_value(MHD_OPTION_LISTEN_SOCKET, config.listen_socket)
+                    : option_pointer(MHD_OPTION_SOCK_ADDR, &addr),
+                option_pointer(MHD_OPTION_HTTPS_MEM_KEY, const_cast<char *>(key)),
+                option_pointer(MHD_OPTION_HTTPS_MEM_CERT, const_cast<char *>(cert)),
+                option_callback(MHD_OPTION_NOTIFY_CONNECTION, &server::connection_callback, this)
+            });
 
-        if (daemon) {
+        if (daemon && config.listen_socket >= 0) {
+            CLOG(INFO, "http.server")
+                << "listening on inherited socket " << config.listen_socket;
+        }
+        else if (daemon) {
             CLOG(INFO, "http.server")
                 << "listening at https://" << address << ":" << port;
         }
@@ -213,18 +627,397 @@ struct server
         }
     }
 
+    using certificate_ptr = std::shared_ptr<gnutls_certificate_credentials_st>;
+
+    // credentials of a PEM key and certificate; throws if either does
+    // not parse or the key does not belong to the certificate
+    static
+    certificate_ptr
+    load_certificate(char const *key, char const *cert)
+    {
+        gnutls_certificate_credentials_t credentials;
+        if (gnutls_certificate_allocate_credentials(&credentials) != GNUTLS_E_SUCCESS) {
+            throw std::runtime_error{"failed to allocate certificate credentials"};
+        }
+        certificate_ptr certificate{credentials, gnutls_certificate_free_credentials};
+
+        gnutls_datum_t key_datum = {
+            reinterpret_cast<unsigned char *>(const_cast<char *>(key)),
+            static_cast<unsigned int>(std::strlen(key))
+        };
+        gnutls_datum_t cert_datum = {
+            reinterpret_cast<unsigned char *>(const_cast<char *>(cert)),
+            static_cast<unsigned int>(std::strlen(cert))
+        };
+        if (gnutls_certificate_set_x509_key_mem(
+                credentials, &cert_datum, &key_datum, GNUTLS_X509_FMT_PEM) < 0) {
+            throw std::invalid_argument{"invalid certificate or key"};
+        }
+        return certificate;
+    }
+
+    // replaces the certificate of the https listener, connections opened
+    // from now on are served with it; throws if the key does not match
+    void
+    set_certificate(char const *key, char const *cert)
+    {
+        auto certificate = load_certificate(key, cert);
+
+        // sessions may still refer to the previous ones, they are kept
+        // until the server stops
+        boost::unique_lock<boost::mutex> lock{certificates_mutex};
+        certificates.push_back(std::move(certificate));
+    }
+
+#ifndef _WIN32
+    // cleartext listener for native clients on the same host, access is
+    // controlled by the permissions of the socket file
+    void
+    start_unix(std::string const &path, mode_t mode)
+    {
+        // the socket is bound in a private directory next to path and
+        // only moved there once it has its final mode, so it is never
+        // reachable with the default permissions
+        auto slash = path.rfind('/');
+        auto private_dir = (slash == std::string::npos ? "" : path.substr(0, slash + 1))
+            + ".trezord-XXXXXX";
+        if (!mkdtemp(&private_dir[0])) {
+            throw std::runtime_error{"failed to create unix socket directory"};
+        }
+        auto private_path = private_dir + "/socket";
+
+        auto cleanup = [&] (int fd) {
+            close(fd);
+            unlink(private_path.c_str());
+            rmdir(private_dir.c_str());
+        };
+
+        sockaddr_un addr;
+
+        if (path.size() >= sizeof(addr.sun_path)
+            || private_path.size() >= sizeof(addr.sun_path)) {
+            rmdir(private_dir.c_str());
+            throw std::invalid_argument{"unix socket path is too long"};
+        }
+        addr.sun_family = AF_UNIX;
+        std::strcpy(addr.sun_path, private_path.c_str());
+
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            rmdir(private_dir.c_str());
+            throw std::runtime_error{"failed to create unix socket"};
+        }
+
+        if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0
+            || chmod(private_path.c_str(), mode) < 0
+            || listen(fd, SOMAXCONN) < 0) {
+            cleanup(fd);
+            throw std::runtime_error{"failed to listen on unix socket"};
+        }
+
+        // a socket file of a previous run is replaced, anything else at
+        // the path is not ours to remove
+        struct stat st;
+        if (lstat(path.c_str(), &st) == 0 && !S_ISSOCK(st.st_mode)) {
+            cleanup(fd);
+            throw std::runtime_error{"unix socket path exists and is not a socket"};
+        }
+        if (rename(private_path.c_str(), path.c_str()) < 0) {
+            cleanup(fd);
+            throw std::runtime_error{"failed to move unix socket into place"};
+        }
+        rmdir(private_dir.c_str());
+
+        // the daemon closes the socket when stopped
+        unix_daemon = start_daemon(0, 0, {
+                option_value(MHD_OPTION_LISTEN_SOCKET, fd)
+            });
+
+        if (unix_daemon) {
+            unix_socket_path = path;
+            CLOG(INFO, "http.server") << "listening at unix:" << path;
+        }
+        else {
+            close(fd);
+            unlink(path.c_str());
+            throw std::runtime_error{"failed to start unix socket server"};
+        }
+    }
+#endif
+
     void
     stop()
     {
+        if (config.before_stop) {
+            config.before_stop();
+        }
+        // run the queued handlers, then answer the connections still
+        // waiting for a deferred response, a daemon cannot be stopped
+        // with suspended connections
+        if (handler_executor) {
+            handler_executor->drain();
+        }
+        parking->close();
         if (daemon) {
             MHD_stop_daemon(daemon);
             daemon = nullptr;
         }
+        if (unix_daemon) {
+            MHD_stop_daemon(unix_daemon);
+            unix_daemon = nullptr;
+#ifndef _WIN32
+            unlink(unix_socket_path.c_str());
+#endif
+        }
+        handler_executor.reset();
+        certificates.clear();
+        if (ticket_key.data) {
+            gnutls_free(ticket_key.data);
+            ticket_key = {nullptr, 0};
+        }
     }
 
 private:
 
     MHD_Daemon *daemon = nullptr;
+    MHD_Daemon *unix_daemon = nullptr;
+    std::string unix_socket_path;
+    std::unique_ptr<utils::async_executor> handler_executor;
+    gnutls_datum_t ticket_key = {nullptr, 0};
+
+    // certificates set after start, the last one is current
+    std::vector<certificate_ptr> certificates;
+    boost::mutex certificates_mutex;
+
+    // requests waiting for their response, completions coming after the
+    // server has stopped find nothing here and are dropped
+    struct parked_requests
+    {
+        using deliver_function = std::function<void (response_data)>;
+
+        bool
+        park(request_data *request, deliver_function deliver)
+        {
+            boost::unique_lock<boost::mutex> lock{mutex};
+            if (closed) {
+                return false;
+            }
+            parked[request] = std::move(deliver);
+            return true;
+        }
+
+        void
+        deliver(request_data *request, response_data response, bool deferred)
+        {
+            boost::unique_lock<boost::mutex> lock{mutex};
+            auto it = parked.find(request);
+            if (it == parked.end()) {
+                return;
+            }
+            auto deliver = std::move(it->second);
+            parked.erase(it);
+            if (deferred) {
+                allow_origin(*request, response);
+            }
+            deliver(std::move(response));
+        }
+
+        void
+        close()
+        {
+            boost::unique_lock<boost::mutex> lock{mutex};
+            closed = true;
+            for (auto &kv: parked) {
+                response_data response{503, "Service Unavailable"};
+                allow_origin(*kv.first, response);
+                kv.second(std::move(response));
+            }
+            parked.clear();
+        }
+
+    private:
+
+        boost::mutex mutex;
+        std::map<request_data *, deliver_function> parked;
+        bool closed = false;
+    };
+
+    std::shared_ptr<parked_requests> parking = std::make_shared<parked_requests>();
+
+    // both listeners share the threading setup and the request handling
+    MHD_Daemon *
+    start_daemon(unsigned int flags,
+                 unsigned int port,
+                 std::vector<MHD_OptionItem> options)
+    {
+        MHD_set_panic_func(&server::panic_callback, this);
+
+        flags |= MHD_ALLOW_UPGRADE;
+        options.push_back(
+            option_callback(MHD_OPTION_NOTIFY_COMPLETED, &server::completed_callback, this));
+        options.push_back(
+            option_callback(MHD_OPTION_EXTERNAL_LOGGER, &server::log_callback, this));
+        options.push_back(
+            option_value(MHD_OPTION_CONNECTION_TIMEOUT, 0));
+
+        if (config.thread_pool_size > 0) {
+#ifdef __linux__
+            flags |= MHD_USE_SELECT_INTERNALLY | MHD_USE_EPOLL_LINUX_ONLY;
+#else
+            flags |= MHD_USE_SELECT_INTERNALLY;
+#endif
+            flags |= MHD_USE_SUSPEND_RESUME;
+            options.push_back(
+                option_value(MHD_OPTION_THREAD_POOL_SIZE, config.thread_pool_size));
+            if (!handler_executor) {
+                handler_executor.reset(
+                    new utils::async_executor{config.handler_threads});
+            }
+        }
+        else {
+            flags |= MHD_USE_THREAD_PER_CONNECTION;
+        }
+        options.push_back(option_value(MHD_OPTION_END, 0));
+
+        return MHD_start_daemon(
+            flags,
+            port,
+            nullptr, nullptr,
+            &server::request_callback, this,
+            MHD_OPTION_ARRAY, options.data(),
+            MHD_OPTION_END);
+    }
+
+    static
+    bool
+    is_unix_connection(server const *self, MHD_Connection *connection)
+    {
+        auto info = MHD_get_connection_info(connection, MHD_CONNECTION_INFO_DAEMON);
+        return self->unix_daemon && info && info->daemon == self->unix_daemon;
+    }
+
+    static
+    MHD_OptionItem
+    option_value(MHD_OPTION name, std::intptr_t value)
+    {
+        return MHD_OptionItem{name, value, nullptr};
+    }
+
+    static
+    MHD_OptionItem
+    option_pointer(MHD_OPTION name, void *ptr_value)
+    {
+        return MHD_OptionItem{name, 0, ptr_value};
+    }
+
+    template <typename F>
+    static
+    MHD_OptionItem
+    option_callback(MHD_OPTION name, F *callback, void *cls)
+    {
+        return MHD_OptionItem{
+            name, reinterpret_cast<std::intptr_t>(callback), cls};
+    }
+
+    void
+    handle_suspended(request_handler const &handler, request_data *request)
+    {
+        // park the connection, so no polling thread is blocked while
+        // the handler waits for the device
+        MHD_suspend_connection(request->connection);
+
+        auto parked = parking;
+        auto parked_ok = parked->park(request, [request] (response_data response) {
+                request->response.reset(new response_data{std::move(response)});
+                MHD_resume_connection(request->connection);
+            });
+        if (!parked_ok) {
+            // stopping, let it go right away
+            request->response.reset(new response_data{503, "Service Unavailable"});
+            MHD_resume_connection(request->connection);
+            return;
+        }
+
+        request->complete = [parked, request] (response_data response) {
+            parked->deliver(request, std::move(response), true);
+        };
+
+        handler_executor->add([this, parked, &handler, request] {
+                try {
+                    auto response = handle_cors_and_delegate(
+                        validator, handler, *request);
+                    if (response.is_deferred()) {
+                        return; // resumed by request->complete
+                    }
+                    parked->deliver(request, std::move(response), false);
+                }
+                catch (...) {
+                    parked->deliver(request,
+                        response_data{500, "Internal Server Error"}, false);
+                }
+            });
+    }
+
+    response_data
+    handle_blocking(request_handler const &handler, request_data *request)
+    {
+        // thread per connection, just wait for deferred responses
+        std::promise<response_data> promise;
+
+        auto parked = parking;
+        auto parked_ok = parked->park(request, [&promise] (response_data response) {
+                promise.set_value(std::move(response));
+            });
+        if (!parked_ok) {
+            return response_data{503, "Service Unavailable"};
+        }
+
+        request->complete = [parked, request] (response_data response) {
+            parked->deliver(request, std::move(response), true);
+        };
+
+        try {
+            auto response = handle_cors_and_delegate(validator, handler, *request);
+            if (!response.is_deferred()) {
+                parked->deliver(request, std::move(response), false);
+            }
+        }
+        catch (...) {
+            parked->deliver(request,
+                response_data{500, "Internal Server Error"}, false);
+        }
+        return promise.get_future().get();
+    }
+
+    static
+    void
+    allow_origin(request_data const &request, response_data &response)
+    {
+        response.add_header("Access-Control-Allow-Origin",
+                            request.get_header("Origin"));
+    }
+
+    void
+    reserve_body(request_data *request)
+    {
+        auto content_length = request->get_header("Content-Length");
+        if (!content_length) {
+            return;
+        }
+
+        try {
+            auto size = boost::lexical_cast<std::size_t>(content_length);
+            if (size > config.max_body_size) {
+                request->body_too_large = true;
+            }
+            else {
+                request->body.reserve(size);
+            }
+        }
+        catch (boost::bad_lexical_cast const &e) {
+            // let the upload itself decide
+        }
+    }
 
     static
     int
@@ -245,40 +1038,62 @@ private:
                 connection,
                 url,
                 method,
-                std::stringstream(),
-                boost::smatch()
+                std::string(),
+                path_params(),
+                false,
+                is_unix_connection(self, connection),
+                nullptr,
+                nullptr
             };
             *con_cls = request;
+            self->reserve_body(request);
             return MHD_YES;
         }
 
         try {
-            // buffer body data
+            // buffer body data, discard everything over the limit
 
             if (*upload_data_size > 0) {
-                request->body.write(upload_data, *upload_data_size);
+                auto size = request->body.size() + *upload_data_size;
+                if (size > self->config.max_body_size) {
+                    request->body_too_large = true;
+                    request->body.clear();
+                    request->body.shrink_to_fit();
+                }
+                if (!request->body_too_large) {
+                    request->body.append(upload_data, *upload_data_size);
+                }
                 *upload_data_size = 0;
                 return MHD_YES;
             }
 
+            if (request->response) {
+                // handler finished while the connection was suspended
+                auto response = std::move(request->response);
+                CLOG(INFO, "http.server") << "-> " << response->status_code;
+                return response->respond_to(request);
+            }
+
             CLOG(INFO, "http.server") << "<- " << method << " " << url;
 
-            // find matching request handler
+            if (request->body_too_large) {
+                response_data response{413, "Request Entity Too Large"};
+                CLOG(INFO, "http.server") << "-> " << response.status_code;
+                return response.respond_to(request);
+            }
 
-            request_handler handler = nullptr;
+            // find matching request handler
 
-            for (auto const &r : self->routes) {
-                if (r.first.match_request(request)) {
-                    handler = r.second;
-                    break;
-                }
-            }
+            auto handler = self->routes.match(request);
 
             // handle the request
 
-            if (handler) {
-                auto response = handle_cors_and_delegate(
-                    self->validator, handler, *request);
+            if (handler && self->handler_executor) {
+                self->handle_suspended(*handler, request);
+                return MHD_YES;
+            }
+            else if (handler) {
+                auto response = self->handle_blocking(*handler, request);
                 CLOG(INFO, "http.server") << "-> " << response.status_code;
                 return response.respond_to(request);
             }
@@ -305,6 +1120,46 @@ private:
         }
     }
 
+    static
+    void
+    connection_callback(void *cls,
+                        MHD_Connection *connection,
+                        void **socket_context,
+                        MHD_ConnectionNotificationCode toe)
+    {
+        server *self = static_cast<server *>(cls);
+
+        auto info = MHD_get_connection_info(
+            connection, MHD_CONNECTION_INFO_GNUTLS_SESSION);
+        if (!info || !info->tls_session) {
+            return;
+        }
+        auto session = static_cast<gnutls_session_t>(info->tls_session);
+
+        if (toe == MHD_CONNECTION_NOTIFY_STARTED) {
+            // called before the handshake
+            gnutls_session_ticket_enable_server(session, &self->ticket_key);
+
+            boost::unique_lock<boost::mutex> lock{self->certificates_mutex};
+            if (!self->certificates.empty()) {
+                gnutls_credentials_set(session, GNUTLS_CRD_CERTIFICATE,
+                                       self->certificates.back().get());
+            }
+        }
+        else if (toe == MHD_CONNECTION_NOTIFY_CLOSED && self->config.tls_stats) {
+            // there is no cipher until the handshake has finished
+            if (gnutls_cipher_get(session) == GNUTLS_CIPHER_NULL) {
+                return;
+            }
+            if (gnutls_session_is_resumed(session)) {
+                self->config.tls_stats->resumed++;
+            }
+            else {
+                self->config.tls_stats->handshakes++;
+            }
+        }
+    }
+
     static
     void
     panic_callback(void *cls, char const *file, unsigned int line, char const *reason)
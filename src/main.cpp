@@ -22,10 +22,19 @@
 #endif
 
 #include <stdio.h>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+
+#ifdef __APPLE__
+#include <sys/stat.h>
+#endif
 
 #include <boost/chrono/chrono.hpp>
 #include <boost/program_options.hpp>
 
+#include <gnutls/x509.h>
+
 #define _ELPP_THREAD_SAFE 1
 #define _ELPP_FORCE_USE_STD_THREAD 1
 #define _ELPP_NO_DEFAULT_LOG_FILE
@@ -36,8 +45,10 @@
 #include "hid.hpp"
 #include "wire.hpp"
 #include "core.hpp"
+#include "signing.hpp"
 #include "http_client.hpp"
 #include "http_server.hpp"
+#include "websocket.hpp"
 #include "http_api.hpp"
 
 _INITIALIZE_EASYLOGGINGPP
@@ -50,6 +61,11 @@ static const auto https_privkey_uri = "https://wallet.trezor.io/data/bridge/cert
 
 static const auto sleep_time = boost::chrono::seconds(10);
 
+// firmware upload is the biggest message, 1MB hex-encoded in JSON
+static const std::size_t default_max_body_size = 4 * 1024 * 1024;
+
+static const unsigned int default_handler_threads = 16;
+
 std::string
 get_default_log_path()
 {
@@ -72,6 +88,195 @@ get_default_log_path()
 #endif
 }
 
+std::string
+get_default_data_path(std::string const &name)
+{
+#ifdef _WIN32
+    if (auto app_data = std::getenv("APPDATA")) {
+        return std::string{app_data} + "\\TREZOR Bridge\\" + name;
+    }
+    else {
+        throw std::runtime_error{"environment variable APPDATA not found"};
+    }
+#elif __APPLE__
+    if (auto home = std::getenv("HOME")) {
+        return std::string{home} + "/Library/Application Support/TREZOR Bridge/" + name;
+    }
+    else {
+        throw std::runtime_error{"environment variable HOME not found"};
+    }
+#else
+    return "/var/lib/trezord/" + name;
+#endif
+}
+
+// socket passed by systemd socket activation, -1 if there is none
+int
+get_activation_socket()
+{
+#ifdef __linux__
+    static const int listen_fds_start = 3; // SD_LISTEN_FDS_START
+
+    auto listen_pid = std::getenv("LISTEN_PID");
+    auto listen_fds = std::getenv("LISTEN_FDS");
+    if (!listen_pid || !listen_fds) {
+        return -1;
+    }
+
+    try {
+        auto pid = boost::lexical_cast<pid_t>(listen_pid);
+        auto fds = boost::lexical_cast<int>(listen_fds);
+
+        // do not pass the sockets on to children
+        unsetenv("LISTEN_PID");
+        unsetenv("LISTEN_FDS");
+        unsetenv("LISTEN_FDNAMES");
+
+        if (pid != getpid() || fds < 1) {
+            return -1;
+        }
+        if (fds > 1) {
+            LOG(WARNING) << "using only the first of " << fds << " activation sockets";
+        }
+        return listen_fds_start;
+    }
+    catch (boost::bad_lexical_cast const &e) {
+        return -1;
+    }
+#else
+    return -1;
+#endif
+}
+
+bool
+read_file(std::string const &path, std::string &data)
+{
+    std::ifstream file{path, std::ios::binary};
+    if (!file) {
+        return false;
+    }
+    data.assign(std::istreambuf_iterator<char>{file},
+                std::istreambuf_iterator<char>{});
+    return !data.empty();
+}
+
+// writes next to path and renames into place, a crash or a full disk
+// never leaves a truncated file behind
+bool
+write_file_tmp(std::string const &path, std::string const &data)
+{
+    auto tmp_path = path + ".tmp";
+    std::ofstream file{tmp_path, std::ios::binary | std::ios::trunc};
+    file << data;
+    if (!file.flush()) {
+        LOG(ERROR) << "could not write " << tmp_path;
+        file.close();
+        std::remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool
+rename_tmp(std::string const &path)
+{
+    auto tmp_path = path + ".tmp";
+#ifdef _WIN32
+    // rename does not replace an existing file here
+    std::remove(path.c_str());
+#endif
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        LOG(ERROR) << "could not replace " << path;
+        std::remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// both files are written before either is replaced, so a key never ends
+// up next to a certificate it does not belong to
+void
+write_certificate(std::string const &cert_path,
+                  std::string const &privkey_path,
+                  std::string const &cert_data,
+                  std::string const &privkey_data)
+{
+    if (!write_file_tmp(cert_path, cert_data)) {
+        return;
+    }
+    if (!write_file_tmp(privkey_path, privkey_data)) {
+        std::remove((cert_path + ".tmp").c_str());
+        return;
+    }
+    if (rename_tmp(privkey_path)) {
+        rename_tmp(cert_path);
+    }
+}
+
+// true if the PEM certificate parses and has not expired yet
+bool
+certificate_is_current(std::string const &cert_data)
+{
+    gnutls_x509_crt_t cert;
+    if (gnutls_x509_crt_init(&cert) != GNUTLS_E_SUCCESS) {
+        return false;
+    }
+    gnutls_datum_t datum = {
+        reinterpret_cast<unsigned char *>(const_cast<char *>(cert_data.data())),
+        static_cast<unsigned int>(cert_data.size())
+    };
+    bool current = gnutls_x509_crt_import(cert, &datum, GNUTLS_X509_FMT_PEM) == GNUTLS_E_SUCCESS
+        && gnutls_x509_crt_get_expiration_time(cert) > std::time(nullptr);
+    gnutls_x509_crt_deinit(cert);
+    return current;
+}
+
+// true if the https listener can be started with the key and certificate
+bool
+certificate_is_usable(std::string const &cert_data,
+                      std::string const &privkey_data)
+{
+    try {
+        trezord::http_server::server::load_certificate(
+            privkey_data.c_str(), cert_data.c_str());
+        return certificate_is_current(cert_data);
+    }
+    catch (std::exception const &e) {
+        return false;
+    }
+}
+
+void
+fetch_certificate(std::string &cert_data, std::string &privkey_data)
+{
+    using namespace trezord;
+    cert_data = http_client::request_uri_to_string(https_cert_uri);
+    privkey_data = http_client::request_uri_to_string(https_privkey_uri);
+    if (!certificate_is_usable(cert_data, privkey_data)) {
+        throw std::runtime_error{"fetched certificate is invalid or expired"};
+    }
+}
+
+void
+refresh_certificate(trezord::http_server::server &server,
+                    std::string const &cert_path,
+                    std::string const &privkey_path)
+{
+    // the running server switches to the refreshed certificate, which
+    // also checks that the key belongs to it before anything is saved
+    try {
+        std::string cert_data;
+        std::string privkey_data;
+        fetch_certificate(cert_data, privkey_data);
+        server.set_certificate(privkey_data.c_str(), cert_data.c_str());
+        write_certificate(cert_path, privkey_path, cert_data, privkey_data);
+        LOG(INFO) << "refreshed certificate in " << cert_path;
+    }
+    catch (std::exception const &e) {
+        LOG(ERROR) << "could not refresh certificate: " << e.what();
+    }
+}
+
 void
 configure_logging()
 {
@@ -105,7 +310,16 @@ void
 start_server(std::string const &cert_data,
              std::string const &privkey_data,
              std::string const &address,
-             unsigned int port)
+             unsigned int port,
+             trezord::http_server::server_config const &server_config,
+             std::string const &config_path,
+             std::string const &default_config_path,
+             std::string const &unix_socket_path,
+             unsigned int unix_socket_mode,
+             std::set<std::string> const &cacheable_messages,
+             std::string const &cert_path,
+             std::string const &privkey_path,
+             bool refresh_cert)
 {
     using namespace trezord;
 
@@ -113,25 +327,54 @@ start_server(std::string const &cert_data,
     using std::placeholders::_1;
     using http_api::handler;
 
-    http_api::handler api_handler{
-        std::unique_ptr<core::kernel>{new core::kernel}};
+    std::unique_ptr<core::kernel> kernel{new core::kernel{config_path, cacheable_messages}};
+
+    // be usable before the first /configure, fall back to the default
+    // configuration if the saved one is missing or expired
+    bool restored = !config_path.empty() && kernel->restore_config(config_path);
+    if (!restored && !default_config_path.empty()) {
+        kernel->restore_config(default_config_path);
+    }
+
+    http_server::tls_statistics tls_stats;
+    http_server::server_config config = server_config;
+    config.tls_stats = &tls_stats;
+
+    http_api::handler api_handler{std::move(kernel), &tls_stats};
+    config.before_stop = [&] { api_handler.stop(); };
     http_server::route_table api_routes = {
-        {{"GET",  "/"},             bind(&handler::handle_index, &api_handler, _1) },
-        {{"GET",  "/listen"},       bind(&handler::handle_listen, &api_handler, _1) },
-        {{"GET",  "/enumerate"},    bind(&handler::handle_enumerate, &api_handler, _1) },
-        {{"POST", "/listen"},       bind(&handler::handle_listen, &api_handler, _1) },
-        {{"POST", "/configure"},    bind(&handler::handle_configure, &api_handler, _1) },
-        {{"POST", "/acquire/([^/]+)"}, bind(&handler::handle_acquire, &api_handler, _1) },
-        {{"POST", "/acquire/([^/]+)/([^/]+)"}, bind(&handler::handle_acquire, &api_handler, _1) },
-        {{"POST", "/release/(.+)"}, bind(&handler::handle_release, &api_handler, _1) },
-        {{"POST", "/call/(.+)"},    bind(&handler::handle_call, &api_handler, _1) },
-        {{".*",   ".*"},            bind(&handler::handle_404, &api_handler, _1) }
+        {{"GET",  "/"},                         bind(&handler::handle_index, &api_handler, _1) },
+        {{"GET",  "/listen"},                   bind(&handler::handle_listen, &api_handler, _1) },
+        {{"GET",  "/enumerate"},                bind(&handler::handle_enumerate, &api_handler, _1) },
+        {{"POST", "/listen"},                   bind(&handler::handle_listen, &api_handler, _1) },
+        {{"POST", "/configure"},                bind(&handler::handle_configure, &api_handler, _1) },
+        {{"POST", "/acquire/:path"},            bind(&handler::handle_acquire, &api_handler, _1) },
+        {{"POST", "/acquire/:path/:previous"},  bind(&handler::handle_acquire, &api_handler, _1) },
+        {{"POST", "/acquire/serial/:serial"},   bind(&handler::handle_acquire, &api_handler, _1) },
+        {{"POST", "/acquire/serial/:serial/:previous"}, bind(&handler::handle_acquire, &api_handler, _1) },
+        {{"POST", "/acquire-any"},              bind(&handler::handle_acquire_any, &api_handler, _1) },
+        {{"POST", "/release/*session"},         bind(&handler::handle_release, &api_handler, _1) },
+        {{"POST", "/call/*session"},            bind(&handler::handle_call, &api_handler, _1) },
+        {{"POST", "/call-batch/*session"},      bind(&handler::handle_call_batch, &api_handler, _1) },
+        {{"POST", "/call-many"},                bind(&handler::handle_call_many, &api_handler, _1) },
+        {{"POST", "/sign-tx/*session"},         bind(&handler::handle_sign_tx, &api_handler, _1) },
+        {{"POST", "/firmware/*session"},        bind(&handler::handle_firmware_upload, &api_handler, _1) },
+        {{"GET",  "/websocket/*session"},       bind(&handler::handle_websocket, &api_handler, _1) },
+        {{"*",    "*"},                         bind(&handler::handle_404, &api_handler, _1) }
     };
     http_server::server server{api_routes, [&] (char const *origin) {
             return api_handler.is_origin_allowed(origin);
-        }};
+        }, config};
 
     server.start(port, address.c_str(), privkey_data.c_str(), cert_data.c_str());
+#ifndef _WIN32
+    if (!unix_socket_path.empty()) {
+        server.start_unix(unix_socket_path, unix_socket_mode);
+    }
+#endif
+    if (refresh_cert) {
+        boost::thread{refresh_certificate, std::ref(server), cert_path, privkey_path}.detach();
+    }
     for (;;) {
         boost::this_thread::sleep_for(sleep_time);
     }
@@ -153,6 +396,29 @@ main(int argc, char *argv[])
     desc.add_options()
         ("foreground,f", "run in foreground, don't fork into background")
         ("help,h", "produce help message")
+        ("max-body-size", po::value<std::size_t>()->default_value(default_max_body_size),
+         "maximum size of a request body in bytes")
+        ("thread-pool", po::value<unsigned int>()->default_value(0),
+         "number of polling threads, 0 for a thread per connection")
+        ("handler-threads", po::value<unsigned int>()->default_value(default_handler_threads),
+         "number of request handler threads, used with --thread-pool")
+        ("config-file", po::value<std::string>()->default_value(get_default_data_path("config.hex")),
+         "file the last configuration is saved to and restored from, empty to disable")
+        ("default-config", po::value<std::string>()->default_value(""),
+         "signed configuration used until a client configures the bridge")
+        ("cert-file", po::value<std::string>()->default_value(get_default_data_path("localback.crt")),
+         "local copy of the https certificate, fetched if missing")
+        ("key-file", po::value<std::string>()->default_value(get_default_data_path("localback.key")),
+         "local copy of the https private key, fetched if missing")
+        ("no-cert-refresh", "don't refresh the local certificate in the background")
+        ("cache-messages", po::value<std::string>()->default_value(""),
+         "comma separated read-only messages to cache responses of, e.g. GetFeatures,GetPublicKey,GetAddress")
+#ifndef _WIN32
+        ("unix-socket", po::value<std::string>()->default_value(""),
+         "also serve plain http on this unix socket, for local native clients")
+        ("unix-socket-mode", po::value<std::string>()->default_value("0660"),
+         "permissions of the unix socket, in octal")
+#endif
     ;
     po::variables_map vm;
     po::store(po::parse_command_line(argc, argv, desc), vm);
@@ -163,6 +429,36 @@ main(int argc, char *argv[])
         return 1;
     }
 
+#ifndef _WIN32
+    auto unix_socket_path = vm["unix-socket"].as<std::string>();
+    unsigned long unix_socket_mode = 0;
+    try {
+        auto mode = vm["unix-socket-mode"].as<std::string>();
+        std::size_t end = 0;
+        unix_socket_mode = std::stoul(mode, &end, 8);
+        if (end != mode.size() || unix_socket_mode > 0777) {
+            throw std::invalid_argument{mode};
+        }
+    }
+    catch (std::logic_error const &) {
+        std::cout << "invalid --unix-socket-mode, expecting octal permissions\n\n"
+                  << desc << "\n";
+        return 1;
+    }
+#else
+    std::string unix_socket_path;
+    unsigned int unix_socket_mode = 0;
+#endif
+
+    std::set<std::string> cacheable_messages;
+    auto cache_messages = vm["cache-messages"].as<std::string>();
+    if (!cache_messages.empty()) {
+        boost::split(cacheable_messages, cache_messages, boost::is_any_of(","));
+    }
+
+    // has to be checked before forking, it is bound to our pid
+    auto listen_socket = get_activation_socket();
+
 #if defined(__linux__) || defined(__FreeBSD__)
     if (!vm.count("foreground")) {
         if (daemon(0, 0) < 0) {
@@ -172,14 +468,36 @@ main(int argc, char *argv[])
     }
 #endif
 
+#ifdef __APPLE__
+    // not created by the installer, it is per user
+    mkdir(get_default_data_path("").c_str(), 0755);
+#endif
+
+    auto cert_path = vm["cert-file"].as<std::string>();
+    auto privkey_path = vm["key-file"].as<std::string>();
+
     std::string cert_data;
     std::string privkey_data;
 
+    // start from the local copy, so startup does not depend on network;
+    // an expired or damaged one is fetched again
+    bool local_cert = read_file(cert_path, cert_data)
+        && read_file(privkey_path, privkey_data)
+        && certificate_is_usable(cert_data, privkey_data);
+
+    // the certificate just fetched needs no refresh
+    bool refresh_cert = local_cert && !vm.count("no-cert-refresh");
+
+    if (local_cert) {
+        LOG(INFO) << "using certificate from " << cert_path;
+        goto start_serve;
+    }
+    LOG(INFO) << "no current certificate in " << cert_path;
+
 start_fetch:
     try {
-        using namespace trezord;
-        cert_data = http_client::request_uri_to_string(https_cert_uri);
-        privkey_data = http_client::request_uri_to_string(https_privkey_uri);
+        fetch_certificate(cert_data, privkey_data);
+        write_certificate(cert_path, privkey_path, cert_data, privkey_data);
     }
     catch (std::exception const &e) {
         LOG(ERROR) << e.what();
@@ -193,10 +511,32 @@ start_serve:
         start_server(cert_data,
                      privkey_data,
                      server_address,
-                     server_port);
+                     server_port,
+                     {vm["max-body-size"].as<std::size_t>(),
+                      vm["thread-pool"].as<unsigned int>(),
+                      vm["handler-threads"].as<unsigned int>(),
+                      listen_socket,
+                      nullptr,
+                      nullptr},
+                     vm["config-file"].as<std::string>(),
+                     vm["default-config"].as<std::string>(),
+                     unix_socket_path,
+                     unix_socket_mode,
+                     cacheable_messages,
+                     cert_path,
+                     privkey_path,
+                     refresh_cert);
     }
     catch (std::exception const &e) {
         LOG(ERROR) << e.what();
+        if (listen_socket >= 0) {
+            // stopping the daemon closed the activation socket, a retry
+            // would never listen again; systemd restarts us with a new one
+            LOG(ERROR) << "cannot serve on the activation socket, exiting";
+            return 1;
+        }
+        // the certificate was checked above, failures to start have
+        // other causes and a fresh copy would not help
         LOG(INFO) << "sleeping for " << sleep_time.count() << "s";
         boost::this_thread::sleep_for(sleep_time);
         goto start_serve;
@@ -0,0 +1,480 @@
+/*
+ * This file is part of the TREZOR project.
+ *
+ * Copyright (C) 2014 SatoshiLabs
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "protobuf/state.hpp"
+#include "cbor.hpp"
+
+#include <limits>
+#include <stdexcept>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/repeated_field.h>
+
+namespace trezord
+{
+namespace protobuf
+{
+
+namespace pb = google::protobuf;
+
+/**
+ * Same message layout as json_codec, {"type": ..., "message": {...}},
+ * but bytes fields are carried as native CBOR byte strings.
+ */
+struct cbor_codec
+{
+    cbor_codec(state *s)
+        : protobuf_state(s)
+    {}
+
+    void
+    protobuf_to_typed_cbor(pb::Message const &msg, cbor::writer &w)
+    {
+        w.write_map_header(2);
+        w.write_text("type");
+        w.write_text(msg.GetDescriptor()->name());
+        w.write_text("message");
+        protobuf_to_cbor(msg, w);
+    }
+
+    pb::Message *
+    typed_cbor_to_protobuf(cbor::reader &r)
+    {
+        static const std::size_t missing = -1;
+
+        std::string name;
+        std::size_t data_position = missing;
+
+        // "type" and "message" can come in any order, remember where
+        // the message starts and come back to it once the type is known
+        for (auto n = r.read_map_header(); n > 0; n--) {
+            auto key = r.read_text();
+            if (key == "type") {
+                name = r.read_text();
+            }
+            else if (key == "message") {
+                data_position = r.position();
+                r.skip();
+            }
+            else {
+                r.skip();
+            }
+        }
+
+        if (name.empty()) {
+            throw std::invalid_argument("expecting CBOR text");
+        }
+
+        auto descriptor = protobuf_state->descriptor_pool
+            .FindMessageTypeByName(name);
+        if (!descriptor) {
+            throw std::invalid_argument("unknown message");
+        }
+
+        auto prototype = protobuf_state->message_factory
+            .GetPrototype(descriptor);
+
+        std::unique_ptr<pb::Message> msg{prototype->New()};
+        if (data_position != missing) {
+            auto end_position = r.position();
+            r.seek(data_position);
+            cbor_to_protobuf(r, *msg);
+            r.seek(end_position);
+        }
+        return msg.release();
+    }
+
+private:
+
+    state *protobuf_state;
+
+    // 32-bit fields are range checked instead of truncated, the same
+    // as Json::Value::asInt and asUInt do for the JSON codec
+
+    static
+    std::int32_t
+    read_int32(cbor::reader &r)
+    {
+        auto value = r.read_int();
+        if (value < std::numeric_limits<std::int32_t>::min()
+            || value > std::numeric_limits<std::int32_t>::max()) {
+            throw std::invalid_argument("integer out of 32-bit range");
+        }
+        return static_cast<std::int32_t>(value);
+    }
+
+    static
+    std::uint32_t
+    read_uint32(cbor::reader &r)
+    {
+        auto value = r.read_uint();
+        if (value > std::numeric_limits<std::uint32_t>::max()) {
+            throw std::invalid_argument("integer out of 32-bit range");
+        }
+        return static_cast<std::uint32_t>(value);
+    }
+
+    void
+    protobuf_to_cbor(pb::Message const &msg, cbor::writer &w)
+    {
+        auto ref = msg.GetReflection();
+
+        // only set fields and non-empty repeated fields
+        std::vector<pb::FieldDescriptor const *> fields;
+        ref->ListFields(msg, &fields);
+
+        w.write_map_header(fields.size());
+
+        for (auto fd: fields) {
+            try {
+                w.write_text(fd->name());
+                if (fd->is_repeated()) {
+                    int field_size = ref->FieldSize(msg, fd);
+                    w.write_array_header(field_size);
+                    for (int i = 0; i < field_size; i++) {
+                        serialize_repeated_field_item(msg, *ref, *fd, i, w);
+                    }
+                }
+                else {
+                    serialize_single_field(msg, *ref, *fd, w);
+                }
+            }
+            catch (std::exception const &e) {
+                throw std::invalid_argument("error while serializing "
+                                            + fd->full_name()
+                                            + ", caused by: "
+                                            + e.what());
+            }
+        }
+    }
+
+    void
+    cbor_to_protobuf(cbor::reader &r, pb::Message &msg)
+    {
+        if (r.peek_type() != cbor::major_type::map) {
+            throw std::invalid_argument("expecting CBOR map");
+        }
+
+        auto md = msg.GetDescriptor();
+        auto ref = msg.GetReflection();
+
+        for (auto n = r.read_map_header(); n > 0; n--) {
+            auto fname = r.read_text();
+            auto fd = md->FindFieldByName(fname);
+
+            if (!fd) {
+                r.skip();
+                continue;
+            }
+            try {
+                if (fd->is_repeated()) {
+                    ref->ClearField(&msg, fd);
+                    for (auto i = r.read_array_header(); i > 0; i--) {
+                        parse_repeated_field_item(msg, *ref, *fd, r);
+                    }
+                }
+                else {
+                    parse_single_field(msg, *ref, *fd, r);
+                }
+            }
+            catch (std::exception const &e) {
+                throw std::invalid_argument("error while parsing "
+                                            + fd->full_name()
+                                            + ", caused by: "
+                                            + e.what());
+            }
+        }
+    }
+
+    void
+    serialize_single_field(const pb::Message &msg,
+                           const pb::Reflection &ref,
+                           const pb::FieldDescriptor &fd,
+                           cbor::writer &w)
+    {
+        switch (fd.type()) {
+
+        case pb::FieldDescriptor::TYPE_DOUBLE:
+            w.write_double(ref.GetDouble(msg, &fd));
+            break;
+
+        case pb::FieldDescriptor::TYPE_FLOAT:
+            w.write_double(ref.GetFloat(msg, &fd));
+            break;
+
+        case pb::FieldDescriptor::TYPE_INT64:
+        case pb::FieldDescriptor::TYPE_SFIXED64:
+        case pb::FieldDescriptor::TYPE_SINT64:
+            w.write_int(ref.GetInt64(msg, &fd));
+            break;
+
+        case pb::FieldDescriptor::TYPE_UINT64:
+        case pb::FieldDescriptor::TYPE_FIXED64:
+            w.write_uint(ref.GetUInt64(msg, &fd));
+            break;
+
+        case pb::FieldDescriptor::TYPE_INT32:
+        case pb::FieldDescriptor::TYPE_SFIXED32:
+        case pb::FieldDescriptor::TYPE_SINT32:
+            w.write_int(ref.GetInt32(msg, &fd));
+            break;
+
+        case pb::FieldDescriptor::TYPE_UINT32:
+        case pb::FieldDescriptor::TYPE_FIXED32:
+            w.write_uint(ref.GetUInt32(msg, &fd));
+            break;
+
+        case pb::FieldDescriptor::TYPE_BOOL:
+            w.write_bool(ref.GetBool(msg, &fd));
+            break;
+
+        case pb::FieldDescriptor::TYPE_STRING:
+            w.write_text(ref.GetString(msg, &fd));
+            break;
+
+        case pb::FieldDescriptor::TYPE_BYTES:
+            w.write_bytes(ref.GetString(msg, &fd));
+            break;
+
+        case pb::FieldDescriptor::TYPE_ENUM:
+            w.write_text(ref.GetEnum(msg, &fd)->name());
+            break;
+
+        case pb::FieldDescriptor::TYPE_MESSAGE:
+            protobuf_to_cbor(ref.GetMessage(msg, &fd), w);
+            break;
+
+        default:
+            throw std::invalid_argument("field of unsupported type");
+        }
+    }
+
+    void
+    serialize_repeated_field_item(const pb::Message &msg,
+                                  const pb::Reflection &ref,
+                                  const pb::FieldDescriptor &fd,
+                                  int i,
+                                  cbor::writer &w)
+    {
+        switch (fd.type()) {
+
+        case pb::FieldDescriptor::TYPE_DOUBLE:
+            w.write_double(ref.GetRepeatedDouble(msg, &fd, i));
+            break;
+
+        case pb::FieldDescriptor::TYPE_FLOAT:
+            w.write_double(ref.GetRepeatedFloat(msg, &fd, i));
+            break;
+
+        case pb::FieldDescriptor::TYPE_INT64:
+        case pb::FieldDescriptor::TYPE_SFIXED64:
+        case pb::FieldDescriptor::TYPE_SINT64:
+            w.write_int(ref.GetRepeatedInt64(msg, &fd, i));
+            break;
+
+        case pb::FieldDescriptor::TYPE_UINT64:
+        case pb::FieldDescriptor::TYPE_FIXED64:
+            w.write_uint(ref.GetRepeatedUInt64(msg, &fd, i));
+            break;
+
+        case pb::FieldDescriptor::TYPE_INT32:
+        case pb::FieldDescriptor::TYPE_SFIXED32:
+        case pb::FieldDescriptor::TYPE_SINT32:
+            w.write_int(ref.GetRepeatedInt32(msg, &fd, i));
+            break;
+
+        case pb::FieldDescriptor::TYPE_UINT32:
+        case pb::FieldDescriptor::TYPE_FIXED32:
+            w.write_uint(ref.GetRepeatedUInt32(msg, &fd, i));
+            break;
+
+        case pb::FieldDescriptor::TYPE_BOOL:
+            w.write_bool(ref.GetRepeatedBool(msg, &fd, i));
+            break;
+
+        case pb::FieldDescriptor::TYPE_STRING:
+            w.write_text(ref.GetRepeatedString(msg, &fd, i));
+            break;
+
+        case pb::FieldDescriptor::TYPE_BYTES:
+            w.write_bytes(ref.GetRepeatedString(msg, &fd, i));
+            break;
+
+        case pb::FieldDescriptor::TYPE_ENUM:
+            w.write_text(ref.GetRepeatedEnum(msg, &fd, i)->name());
+            break;
+
+        case pb::FieldDescriptor::TYPE_MESSAGE:
+            protobuf_to_cbor(ref.GetRepeatedMessage(msg, &fd, i), w);
+            break;
+
+        default:
+            throw std::invalid_argument("field of unsupported type");
+        }
+    }
+
+    void
+    parse_single_field(pb::Message &msg,
+                       const pb::Reflection &ref,
+                       const pb::FieldDescriptor &fd,
+                       cbor::reader &r)
+    {
+        switch (fd.type()) {
+
+        case pb::FieldDescriptor::TYPE_DOUBLE:
+            ref.SetDouble(&msg, &fd, r.read_double());
+            break;
+
+        case pb::FieldDescriptor::TYPE_FLOAT:
+            ref.SetFloat(&msg, &fd, r.read_double());
+            break;
+
+        case pb::FieldDescriptor::TYPE_INT64:
+        case pb::FieldDescriptor::TYPE_SFIXED64:
+        case pb::FieldDescriptor::TYPE_SINT64:
+            ref.SetInt64(&msg, &fd, r.read_int());
+            break;
+
+        case pb::FieldDescriptor::TYPE_UINT64:
+        case pb::FieldDescriptor::TYPE_FIXED64:
+            ref.SetUInt64(&msg, &fd, r.read_uint());
+            break;
+
+        case pb::FieldDescriptor::TYPE_INT32:
+        case pb::FieldDescriptor::TYPE_SFIXED32:
+        case pb::FieldDescriptor::TYPE_SINT32:
+            ref.SetInt32(&msg, &fd, read_int32(r));
+            break;
+
+        case pb::FieldDescriptor::TYPE_UINT32:
+        case pb::FieldDescriptor::TYPE_FIXED32:
+            ref.SetUInt32(&msg, &fd, read_uint32(r));
+            break;
+
+        case pb::FieldDescriptor::TYPE_BOOL:
+            ref.SetBool(&msg, &fd, r.read_bool());
+            break;
+
+        case pb::FieldDescriptor::TYPE_STRING:
+            ref.SetString(&msg, &fd, r.read_text());
+            break;
+
+        case pb::FieldDescriptor::TYPE_BYTES:
+            ref.SetString(&msg, &fd, r.read_bytes());
+            break;
+
+        case pb::FieldDescriptor::TYPE_ENUM: {
+            auto ed = fd.enum_type();
+            auto evd = ed->FindValueByName(r.read_text());
+            if (!evd) {
+                throw std::invalid_argument("unknown enum value");
+            }
+            ref.SetEnum(&msg, &fd, evd);
+            break;
+        }
+
+        case pb::FieldDescriptor::TYPE_MESSAGE: {
+            auto mf = &protobuf_state->message_factory;
+            auto fm = ref.MutableMessage(&msg, &fd, mf);
+            cbor_to_protobuf(r, *fm);
+            break;
+        }
+
+        default:
+            throw std::invalid_argument("field of unsupported type");
+        }
+    }
+
+    void
+    parse_repeated_field_item(pb::Message &msg,
+                              const pb::Reflection &ref,
+                              const pb::FieldDescriptor &fd,
+                              cbor::reader &r)
+    {
+        switch (fd.type()) {
+
+        case pb::FieldDescriptor::TYPE_DOUBLE:
+            ref.AddDouble(&msg, &fd, r.read_double());
+            break;
+
+        case pb::FieldDescriptor::TYPE_FLOAT:
+            ref.AddFloat(&msg, &fd, r.read_double());
+            break;
+
+        case pb::FieldDescriptor::TYPE_INT64:
+        case pb::FieldDescriptor::TYPE_SFIXED64:
+        case pb::FieldDescriptor::TYPE_SINT64:
+            ref.AddInt64(&msg, &fd, r.read_int());
+            break;
+
+        case pb::FieldDescriptor::TYPE_UINT64:
+        case pb::FieldDescriptor::TYPE_FIXED64:
+            ref.AddUInt64(&msg, &fd, r.read_uint());
+            break;
+
+        case pb::FieldDescriptor::TYPE_INT32:
+        case pb::FieldDescriptor::TYPE_SFIXED32:
+        case pb::FieldDescriptor::TYPE_SINT32:
+            ref.AddInt32(&msg, &fd, read_int32(r));
+            break;
+
+        case pb::FieldDescriptor::TYPE_UINT32:
+        case pb::FieldDescriptor::TYPE_FIXED32:
+            ref.AddUInt32(&msg, &fd, read_uint32(r));
+            break;
+
+        case pb::FieldDescriptor::TYPE_BOOL:
+            ref.AddBool(&msg, &fd, r.read_bool());
+            break;
+
+        case pb::FieldDescriptor::TYPE_STRING:
+            ref.AddString(&msg, &fd, r.read_text());
+            break;
+
+        case pb::FieldDescriptor::TYPE_BYTES:
+            ref.AddString(&msg, &fd, r.read_bytes());
+            break;
+
+        case pb::FieldDescriptor::TYPE_ENUM: {
+            auto ed = fd.enum_type();
+            auto evd = ed->FindValueByName(r.read_text());
+            if (!evd) {
+                throw std::invalid_argument("unknown enum value");
+            }
+            ref.AddEnum(&msg, &fd, evd);
+            break;
+        }
+
+        case pb::FieldDescriptor::TYPE_MESSAGE: {
+            auto mf = &protobuf_state->message_factory;
+            auto fm = ref.AddMessage(&msg, &fd, mf);
+            cbor_to_protobuf(r, *fm);
+            break;
+        }
+
+        default:
+            throw std::invalid_argument("field of unsupported type");
+        }
+    }
+};
+
+}
+}
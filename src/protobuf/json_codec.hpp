@@ -35,6 +35,34 @@ namespace protobuf
 
 namespace pb = google::protobuf;
 
+enum class bytes_encoding
+{
+    hex,
+    base64
+};
+
+std::string
+encode_bytes(std::string const &bytes, bytes_encoding encoding)
+{
+    switch (encoding) {
+    case bytes_encoding::base64:
+        return utils::base64_encode(bytes);
+    default:
+        return utils::hex_encode(bytes);
+    }
+}
+
+std::string
+decode_bytes(std::string const &str, bytes_encoding encoding)
+{
+    switch (encoding) {
+    case bytes_encoding::base64:
+        return utils::base64_decode(str);
+    default:
+        return utils::hex_decode(str);
+    }
+}
+
 struct json_codec
 {
     json_codec(state *s)
@@ -42,16 +70,18 @@ struct json_codec
     {}
 
     Json::Value
-    protobuf_to_typed_json(pb::Message const &msg)
+    protobuf_to_typed_json(pb::Message const &msg,
+                           bytes_encoding encoding = bytes_encoding::hex)
     {
         Json::Value val(Json::objectValue);
         val["type"] = msg.GetDescriptor()->name();
-        val["message"] = protobuf_to_json(msg);
+        val["message"] = protobuf_to_json(msg, encoding);
         return val;
     }
 
     pb::Message *
-    typed_json_to_protobuf(Json::Value const &val)
+    typed_json_to_protobuf(Json::Value const &val,
+                           bytes_encoding encoding = bytes_encoding::hex)
     {
         auto name = val["type"];
         auto data = val["message"];
@@ -70,7 +100,7 @@ struct json_codec
             .GetPrototype(descriptor);
 
         pb::Message *msg = prototype->New();
-        json_to_protobuf(data, *msg);
+        json_to_protobuf(data, *msg, encoding);
         return msg;
     }
 
@@ -79,7 +109,8 @@ private:
     state *protobuf_state;
 
     Json::Value
-    protobuf_to_json(pb::Message const &msg)
+    protobuf_to_json(pb::Message const &msg,
+                     bytes_encoding encoding)
     {
         Json::Value val(Json::objectValue);
 
@@ -92,14 +123,14 @@ private:
 
             try {
                 if (fd->is_repeated()) {
-                    val[fname] = serialize_repeated_field(msg, *ref, *fd);
+                    val[fname] = serialize_repeated_field(msg, *ref, *fd, encoding);
                     // no empty arrays for repeated fields
                     if (val[fname].empty()) {
                         val.removeMember(fname);
                     }
                 }
                 else if (ref->HasField(msg, fd)) {
-                    val[fname] = serialize_single_field(msg, *ref, *fd);
+                    val[fname] = serialize_single_field(msg, *ref, *fd, encoding);
                 }
             }
             catch (std::exception const &e) {
@@ -115,7 +146,8 @@ private:
 
     void
     json_to_protobuf(Json::Value const &val,
-                     pb::Message &msg)
+                     pb::Message &msg,
+                     bytes_encoding encoding)
     {
         if (!val.isObject()) {
             throw std::invalid_argument("expecting JSON object");
@@ -134,10 +166,10 @@ private:
             try {
                 if (fd->is_repeated()) {
                     ref->ClearField(&msg, fd);
-                    parse_repeated_field(msg, *ref, *fd, val[fname]);
+                    parse_repeated_field(msg, *ref, *fd, val[fname], encoding);
                 }
                 else {
-                    parse_single_field(msg, *ref, *fd, val[fname]);
+                    parse_single_field(msg, *ref, *fd, val[fname], encoding);
                 }
             }
             catch (std::exception const &e) {
@@ -152,7 +184,8 @@ private:
     Json::Value
     serialize_single_field(const pb::Message &msg,
                            const pb::Reflection &ref,
-                           const pb::FieldDescriptor &fd)
+                           const pb::FieldDescriptor &fd,
+                           bytes_encoding encoding)
     {
         switch (fd.type()) {
 
@@ -187,13 +220,13 @@ private:
             return ref.GetString(msg, &fd);
 
         case pb::FieldDescriptor::TYPE_BYTES:
-            return utils::hex_encode(ref.GetString(msg, &fd));
+            return encode_bytes(ref.GetString(msg, &fd), encoding);
 
         case pb::FieldDescriptor::TYPE_ENUM:
             return ref.GetEnum(msg, &fd)->name();
 
         case pb::FieldDescriptor::TYPE_MESSAGE:
-            return protobuf_to_json(ref.GetMessage(msg, &fd));
+            return protobuf_to_json(ref.GetMessage(msg, &fd), encoding);
 
         default:
             throw std::invalid_argument("field of unsupported type");
@@ -203,14 +236,15 @@ private:
     Json::Value
     serialize_repeated_field(const pb::Message &msg,
                              const pb::Reflection &ref,
-                             const pb::FieldDescriptor &fd)
+                             const pb::FieldDescriptor &fd,
+                             bytes_encoding encoding)
     {
         Json::Value result(Json::arrayValue);
         int field_size = ref.FieldSize(msg, &fd);
         result.resize(field_size);
 
         for (int i = 0; i < field_size; i++) {
-            result[i] = serialize_repeated_field_item(msg, ref, fd, i);
+            result[i] = serialize_repeated_field_item(msg, ref, fd, i, encoding);
         }
 
         return result;
@@ -220,7 +254,8 @@ private:
     serialize_repeated_field_item(const pb::Message &msg,
                                   const pb::Reflection &ref,
                                   const pb::FieldDescriptor &fd,
-                                  int i)
+                                  int i,
+                                  bytes_encoding encoding)
     {
         switch (fd.type()) {
 
@@ -255,13 +290,13 @@ private:
             return ref.GetRepeatedString(msg, &fd, i);
 
         case pb::FieldDescriptor::TYPE_BYTES:
-            return utils::hex_encode(ref.GetRepeatedString(msg, &fd, i));
+            return encode_bytes(ref.GetRepeatedString(msg, &fd, i), encoding);
 
         case pb::FieldDescriptor::TYPE_ENUM:
             return ref.GetRepeatedEnum(msg, &fd, i)->name();
 
         case pb::FieldDescriptor::TYPE_MESSAGE:
-            return protobuf_to_json(ref.GetRepeatedMessage(msg, &fd, i));
+            return protobuf_to_json(ref.GetRepeatedMessage(msg, &fd, i), encoding);
 
         default:
             throw std::invalid_argument("field of unsupported type");
@@ -272,7 +307,8 @@ private:
     parse_single_field(pb::Message &msg,
                        const pb::Reflection &ref,
                        const pb::FieldDescriptor &fd,
-                       const Json::Value &val)
+                       const Json::Value &val,
+                       bytes_encoding encoding)
     {
         switch (fd.type()) {
 
@@ -315,7 +351,7 @@ private:
             break;
 
         case pb::FieldDescriptor::TYPE_BYTES:
-            ref.SetString(&msg, &fd, utils::hex_decode(val.asString()));
+            ref.SetString(&msg, &fd, decode_bytes(val.asString(), encoding));
             break;
 
         case pb::FieldDescriptor::TYPE_ENUM: {
@@ -331,7 +367,7 @@ private:
         case pb::FieldDescriptor::TYPE_MESSAGE: {
             auto mf = &protobuf_state->message_factory;
             auto fm = ref.MutableMessage(&msg, &fd, mf);
-            json_to_protobuf(val, *fm);
+            json_to_protobuf(val, *fm, encoding);
             break;
         }
 
@@ -344,13 +380,14 @@ private:
     parse_repeated_field(pb::Message &msg,
                          const pb::Reflection &ref,
                          const pb::FieldDescriptor &fd,
-                         const Json::Value &val)
+                         const Json::Value &val,
+                         bytes_encoding encoding)
     {
         if (!val.isArray()) {
             throw std::invalid_argument("expecting JSON array");
         }
         for (auto v: val) {
-            parse_repeated_field_item(msg, ref, fd, v);
+            parse_repeated_field_item(msg, ref, fd, v, encoding);
         }
     }
 
@@ -358,7 +395,8 @@ private:
     parse_repeated_field_item(pb::Message &msg,
                               const pb::Reflection &ref,
                               const pb::FieldDescriptor &fd,
-                              const Json::Value &val)
+                              const Json::Value &val,
+                              bytes_encoding encoding)
     {
         switch (fd.type()) {
 
@@ -401,7 +439,7 @@ private:
             break;
 
         case pb::FieldDescriptor::TYPE_BYTES:
-            ref.AddString(&msg, &fd, utils::hex_decode(val.asString()));
+            ref.AddString(&msg, &fd, decode_bytes(val.asString(), encoding));
             break;
 
         case pb::FieldDescriptor::TYPE_ENUM: {
@@ -417,7 +455,7 @@ private:
         case pb::FieldDescriptor::TYPE_MESSAGE: {
             auto mf = &protobuf_state->message_factory;
             auto fm = ref.AddMessage(&msg, &fd, mf);
-            json_to_protobuf(val, *fm);
+            json_to_protobuf(val, *fm, encoding);
             break;
         }
 
@@ -84,6 +84,30 @@ struct wire_codec
                               wire.data.size());
     }
 
+    int
+    find_message_id(std::string const &name)
+    {
+        return find_wire_id(name);
+    }
+
+    int
+    find_bytes_message_id(std::string const &name)
+    {
+        // message has to start with a bytes field number 1 to be written
+        // as a wire::bytes_message
+        auto descriptor = protobuf_state->descriptor_pool
+            .FindMessageTypeByName(name);
+        if (!descriptor) {
+            throw std::invalid_argument("unknown message");
+        }
+        auto fd = descriptor->FindFieldByNumber(1);
+        if (!fd || fd->is_repeated()
+            || fd->type() != pb::FieldDescriptor::TYPE_BYTES) {
+            throw std::invalid_argument("message is not a bytes message");
+        }
+        return find_wire_id(name);
+    }
+
 private:
 
     typedef std::map<
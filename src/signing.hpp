@@ -0,0 +1,275 @@
+/*
+ * This file is part of the TREZOR project.
+ *
+ * Copyright (C) 2014 SatoshiLabs
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <json/json.h>
+
+namespace trezord
+{
+namespace signing
+{
+
+/**
+ * Drives a SignTx flow on the bridge: TxRequests of the device are
+ * answered with TxAcks built from a transaction uploaded as a whole,
+ * ButtonRequests are answered with ButtonAcks.
+ *
+ * Transaction JSON:
+ * {
+ *   "inputs": [TxInputType],
+ *   "outputs": [TxOutputType],
+ *   "transactions": {tx_hash: TransactionType with "bin_outputs"}
+ * }
+ */
+
+struct tx_driver
+{
+    struct invalid_transaction
+        : public std::invalid_argument
+    { using std::invalid_argument::invalid_argument; };
+
+    tx_driver(core::kernel_schema const &sch,
+              Json::Value const &tx,
+              protobuf::bytes_encoding enc)
+        : schema(sch),
+          encoding{enc},
+          transaction(tx),
+          tx_request_id{sch.find_message_id("TxRequest")},
+          button_request_id{sch.find_message_id("ButtonRequest")},
+          button_ack_id{sch.find_message_id("ButtonAck")},
+          cancel_id{sch.find_message_id("Cancel")}
+    {
+        if (!transaction["inputs"].isArray()
+            || !transaction["outputs"].isArray()) {
+            throw invalid_transaction{"expecting inputs and outputs arrays"};
+        }
+        auto const &prev = transaction["transactions"];
+        if (!prev.isNull() && !prev.isObject()) {
+            throw invalid_transaction{"expecting transactions object"};
+        }
+        signatures.resize(transaction["inputs"].size());
+    }
+
+    // device_kernel::reply_function, returns false on the first response
+    // that is not part of the signing flow; a request that cannot be
+    // answered from the transaction cancels the flow on the device
+    bool
+    reply(wire::message const &wire_out, wire::message &wire_reply)
+    {
+        if (is_failed()) {
+            return false; // response to the Cancel
+        }
+        try {
+            return answer(wire_out, wire_reply);
+        }
+        catch (std::exception const &e) {
+            failure = e.what();
+            wire_reply.id = cancel_id;
+            wire_reply.data.clear();
+            return true;
+        }
+    }
+
+    bool
+    is_finished() const
+    { return finished; }
+
+    // the transaction did not answer a request of the device
+    bool
+    is_failed() const
+    { return !failure.empty(); }
+
+    std::string const &
+    failure_reason() const
+    { return failure; }
+
+    Json::Value
+    result() const
+    {
+        Json::Value json_signatures{Json::arrayValue};
+        for (auto const &signature: signatures) {
+            json_signatures.append(
+                protobuf::encode_bytes(signature, encoding));
+        }
+
+        Json::Value json{Json::objectValue};
+        json["signatures"] = json_signatures;
+        json["serializedTx"] = protobuf::encode_bytes(serialized_tx, encoding);
+        return json;
+    }
+
+private:
+
+    core::kernel_schema const &schema;
+    protobuf::bytes_encoding encoding;
+    Json::Value transaction;
+
+    std::uint16_t tx_request_id;
+    std::uint16_t button_request_id;
+    std::uint16_t button_ack_id;
+    std::uint16_t cancel_id;
+
+    bool finished = false;
+    std::string failure;
+    std::vector<std::string> signatures;
+    std::string serialized_tx;
+
+    bool
+    answer(wire::message const &wire_out, wire::message &wire_reply)
+    {
+        if (wire_out.id == button_request_id) {
+            wire_reply.id = button_ack_id;
+            wire_reply.data.clear();
+            return true;
+        }
+        if (wire_out.id != tx_request_id) {
+            return false;
+        }
+
+        Json::Value json_out;
+        schema.wire_to_json(wire_out, json_out, encoding);
+        auto const &request = json_out["message"];
+
+        collect_serialized(request["serialized"]);
+
+        auto request_type = request["request_type"].asString();
+        if (request_type == "TXFINISHED") {
+            finished = true;
+            return false;
+        }
+
+        Json::Value ack{Json::objectValue};
+        ack["type"] = "TxAck";
+        ack["message"]["tx"] = tx_ack(request_type, request["details"]);
+        schema.json_to_wire(ack, wire_reply, encoding);
+        return true;
+    }
+
+    void
+    collect_serialized(Json::Value const &serialized)
+    {
+        if (serialized.isNull()) {
+            return;
+        }
+        if (serialized.isMember("signature_index")) {
+            auto index = serialized["signature_index"].asUInt();
+            if (index >= signatures.size()) {
+                throw invalid_transaction{"signature index out of range"};
+            }
+            signatures[index] = protobuf::decode_bytes(
+                serialized["signature"].asString(), encoding);
+        }
+        if (serialized.isMember("serialized_tx")) {
+            serialized_tx += protobuf::decode_bytes(
+                serialized["serialized_tx"].asString(), encoding);
+        }
+    }
+
+    Json::Value
+    tx_ack(std::string const &request_type, Json::Value const &details)
+    {
+        // without tx_hash the device asks about the signed transaction
+        bool current = !details.isMember("tx_hash");
+        auto const &tx = current
+            ? transaction
+            : previous_transaction(details["tx_hash"].asString());
+        auto index = details["request_index"].asUInt();
+
+        Json::Value ack{Json::objectValue};
+
+        if (request_type == "TXINPUT") {
+            ack["inputs"].append(item(tx["inputs"], index));
+        }
+        else if (request_type == "TXOUTPUT") {
+            if (current) {
+                ack["outputs"].append(item(tx["outputs"], index));
+            }
+            else {
+                ack["bin_outputs"].append(item(tx["bin_outputs"], index));
+            }
+        }
+        else if (request_type == "TXMETA") {
+            // everything but the lists, which are sent item by item, and
+            // the request fields of the signed transaction
+            static const std::set<std::string> skipped = {
+                "inputs", "outputs", "bin_outputs", "extra_data",
+                "transactions", "message"
+            };
+            for (auto const &name: tx.getMemberNames()) {
+                if (!skipped.count(name)) {
+                    ack[name] = tx[name];
+                }
+            }
+            ack["inputs_cnt"] = tx["inputs"].size();
+            ack["outputs_cnt"] = current
+                ? tx["outputs"].size()
+                : tx["bin_outputs"].size();
+            if (tx.isMember("extra_data")) {
+                ack["extra_data_len"] = Json::UInt64(extra_data(tx).size());
+            }
+        }
+        else if (request_type == "TXEXTRADATA") {
+            auto data = extra_data(tx);
+            auto offset = details["extra_data_offset"].asUInt();
+            auto size = details["extra_data_len"].asUInt();
+            if (offset > data.size() || size > data.size() - offset) {
+                throw invalid_transaction{"extra data out of range"};
+            }
+            ack["extra_data"] = protobuf::encode_bytes(
+                data.substr(offset, size), encoding);
+        }
+        else {
+            throw invalid_transaction{"unknown transaction request type"};
+        }
+
+        return ack;
+    }
+
+    Json::Value const &
+    previous_transaction(std::string const &hash) const
+    {
+        auto const &prev = transaction["transactions"];
+        if (!prev.isMember(hash)) {
+            throw invalid_transaction{"missing previous transaction"};
+        }
+        return prev[hash];
+    }
+
+    Json::Value const &
+    item(Json::Value const &list, Json::ArrayIndex index) const
+    {
+        if (!list.isArray() || index >= list.size()) {
+            throw invalid_transaction{"transaction request index out of range"};
+        }
+        return list[index];
+    }
+
+    std::string
+    extra_data(Json::Value const &tx) const
+    {
+        return protobuf::decode_bytes(tx["extra_data"].asString(), encoding);
+    }
+};
+
+}
+}
@@ -17,6 +17,9 @@
  * along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#pragma once
+
+#include <atomic>
 #include <sstream>
 #include <queue>
 
@@ -27,6 +30,10 @@
 #include <boost/algorithm/string.hpp>
 #include <boost/algorithm/hex.hpp>
 
+#include <boost/archive/iterators/base64_from_binary.hpp>
+#include <boost/archive/iterators/binary_from_base64.hpp>
+#include <boost/archive/iterators/transform_width.hpp>
+
 namespace trezord
 {
 namespace utils
@@ -64,14 +71,17 @@ private:
 
 struct async_executor
 {
-    async_executor()
-        : thread{boost::bind(&async_executor::run, this)}
-    { }
+    async_executor(std::size_t thread_count = 1)
+    {
+        for (std::size_t i = 0; i < thread_count; i++) {
+            threads.create_thread(boost::bind(&async_executor::run, this));
+        }
+    }
 
     ~async_executor()
     {
-        thread.interrupt();
-        thread.join();
+        threads.interrupt_all();
+        threads.join_all();
     }
 
     template<typename Callable>
@@ -84,10 +94,21 @@ struct async_executor
         auto task = std::make_shared<task_type>(callable);
         auto future = task->get_future();
 
-        queue.put(std::bind(&task_type::operator(), task));
+        pending_tasks++;
+        queue.put([this, task] {
+                (*task)();
+                pending_tasks--;
+            });
         return std::move(future);
     }
 
+    // tasks queued or running
+    std::size_t
+    pending() const
+    {
+        return pending_tasks;
+    }
+
     template<typename Callable>
     typename std::result_of<Callable()>::type
     await(Callable callable)
@@ -95,19 +116,35 @@ struct async_executor
         return add(callable).get();
     }
 
+    // runs the tasks queued so far and stops, tasks added afterwards
+    // are never run
+    void
+    drain()
+    {
+        for (std::size_t i = 0; i < threads.size(); i++) {
+            queue.put(nullptr);
+        }
+        threads.join_all();
+    }
+
 private:
 
     void
     run()
     {
         while (!boost::this_thread::interruption_requested()) {
-            queue.take()();
+            auto task = queue.take();
+            if (!task) {
+                return; // drained
+            }
+            task();
         }
     }
 
     blocking_queue<
         std::function<void()> > queue;
-    boost::thread thread;
+    boost::thread_group threads;
+    std::atomic<std::size_t> pending_tasks{0};
 };
 
 std::string
@@ -140,5 +177,52 @@ hex_decode(std::string const &hex)
     }
 }
 
+std::string
+base64_encode(std::string const &str)
+{
+    using namespace boost::archive::iterators;
+    using iterator = base64_from_binary<
+        transform_width<std::string::const_iterator, 6, 8> >;
+
+    try {
+        std::string b64{iterator{str.begin()}, iterator{str.end()}};
+        b64.append((3 - str.size() % 3) % 3, '=');
+        return b64;
+    }
+    catch (std::exception const &e) {
+        throw std::invalid_argument{"cannot encode value to base64"};
+    }
+}
+
+std::string
+base64_decode(std::string const &b64)
+{
+    using namespace boost::archive::iterators;
+    using iterator = transform_width<
+        binary_from_base64<std::string::const_iterator>, 8, 6>;
+
+    try {
+        if (b64.size() % 4 != 0) {
+            throw std::invalid_argument{"invalid length"};
+        }
+
+        // padding is not part of the alphabet, decode it as zero bits
+        // and cut the resulting zero bytes off the end
+        auto padding = b64.size() - b64.find_last_not_of('=') - 1;
+        if (padding > 2) {
+            throw std::invalid_argument{"invalid padding"};
+        }
+        std::string unpadded{b64};
+        unpadded.replace(b64.size() - padding, padding, padding, 'A');
+
+        std::string str{iterator{unpadded.cbegin()}, iterator{unpadded.cend()}};
+        str.resize(str.size() - padding);
+        return str;
+    }
+    catch (std::exception const &e) {
+        throw std::invalid_argument{"cannot decode value from base64"};
+    }
+}
+
 }
 }
@@ -0,0 +1,334 @@
+/*
+ * This file is part of the TREZOR project.
+ *
+ * Copyright (C) 2014 SatoshiLabs
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "utils.hpp"
+
+#include <microhttpd.h>
+#include <gnutls/crypto.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#endif
+
+namespace trezord
+{
+namespace websocket
+{
+
+/**
+ * Minimal WebSocket (RFC 6455) server side, over a socket that is
+ * switched to blocking mode
+ */
+
+enum class opcode : std::uint8_t
+{
+    continuation = 0x0,
+    text = 0x1,
+    binary = 0x2,
+    close = 0x8,
+    ping = 0x9,
+    pong = 0xA
+};
+
+// wakes up a thread blocked on the socket, its reads return end of file
+void
+shutdown_socket(MHD_socket socket)
+{
+#ifdef _WIN32
+    shutdown(socket, SD_BOTH);
+#else
+    shutdown(socket, SHUT_RDWR);
+#endif
+}
+
+// value of Sec-WebSocket-Accept for a given Sec-WebSocket-Key
+std::string
+accept_key(std::string const &key)
+{
+    static const auto guid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+    auto data = key + guid;
+    unsigned char digest[20];
+    if (gnutls_hash_fast(GNUTLS_DIG_SHA1, data.data(), data.size(), digest) < 0) {
+        throw std::runtime_error{"failed to hash websocket key"};
+    }
+    return utils::base64_encode(
+        std::string{reinterpret_cast<char const *>(digest), sizeof(digest)});
+}
+
+struct connection
+{
+    struct protocol_error
+        : public std::runtime_error
+    { using std::runtime_error::runtime_error; };
+
+    // with a timeout, reads and writes fail after that many seconds
+    // without progress, so idle or stalled peers do not hold the thread
+    connection(MHD_socket s,
+               std::string const &buffered,
+               std::size_t max_size,
+               int timeout = 0)
+        : socket{s},
+          buffer{buffered},
+          max_message_size{max_size}
+    {
+        // sockets accepted by the http server are non-blocking
+        set_blocking();
+        if (timeout > 0) {
+            set_timeout(timeout);
+        }
+    }
+
+    // reads the next data message, answering control frames on the way;
+    // returns false once the connection is closed
+    bool
+    read_message(opcode &type, std::string &payload)
+    {
+        payload.clear();
+        bool in_message = false;
+
+        for (;;) {
+            bool fin;
+            opcode op;
+            std::string data;
+
+            if (!read_frame(fin, op, data)) {
+                return false;
+            }
+
+            switch (op) {
+
+            case opcode::ping:
+                send(opcode::pong, data);
+                continue;
+
+            case opcode::pong:
+                continue;
+
+            case opcode::close:
+                send(opcode::close, data.substr(0, 2));
+                return false;
+
+            case opcode::continuation:
+                if (!in_message) {
+                    throw protocol_error{"unexpected continuation frame"};
+                }
+                break;
+
+            case opcode::text:
+            case opcode::binary:
+                if (in_message) {
+                    throw protocol_error{"expecting continuation frame"};
+                }
+                in_message = true;
+                type = op;
+                break;
+
+            default:
+                throw protocol_error{"unknown opcode"};
+            }
+
+            if (payload.size() + data.size() > max_message_size) {
+                throw protocol_error{"message too large"};
+            }
+            payload += data;
+
+            if (fin) {
+                return true;
+            }
+        }
+    }
+
+    void
+    send(opcode type, std::string const &payload)
+    {
+        std::string frame;
+        frame.reserve(payload.size() + 10);
+        frame.push_back(static_cast<char>(0x80 | static_cast<std::uint8_t>(type)));
+
+        auto size = payload.size();
+        if (size < 126) {
+            frame.push_back(static_cast<char>(size));
+        }
+        else if (size <= 0xFFFF) {
+            frame.push_back(126);
+            frame.push_back(static_cast<char>((size >> 8) & 0xFF));
+            frame.push_back(static_cast<char>(size & 0xFF));
+        }
+        else {
+            frame.push_back(127);
+            for (int i = 7; i >= 0; i--) {
+                frame.push_back(static_cast<char>(
+                    (static_cast<std::uint64_t>(size) >> (i * 8)) & 0xFF));
+            }
+        }
+        frame += payload;
+
+        write_all(frame.data(), frame.size());
+    }
+
+private:
+
+    MHD_socket socket;
+    std::string buffer;
+    std::size_t max_message_size;
+
+    bool
+    read_frame(bool &fin, opcode &op, std::string &data)
+    {
+        std::uint8_t head[2];
+        if (!read_exact(head, sizeof(head))) {
+            return false;
+        }
+
+        fin = head[0] & 0x80;
+        op = static_cast<opcode>(head[0] & 0x0F);
+        bool masked = head[1] & 0x80;
+        std::uint64_t size = head[1] & 0x7F;
+
+        if (!masked) {
+            throw protocol_error{"client frames have to be masked"};
+        }
+
+        if (size == 126 || size == 127) {
+            std::uint8_t ext[8];
+            std::size_t ext_size = (size == 126) ? 2 : 8;
+            if (!read_exact(ext, ext_size)) {
+                return false;
+            }
+            size = 0;
+            for (std::size_t i = 0; i < ext_size; i++) {
+                size = (size << 8) | ext[i];
+            }
+        }
+        if (size > max_message_size) {
+            throw protocol_error{"message too large"};
+        }
+
+        std::uint8_t mask[4];
+        if (!read_exact(mask, sizeof(mask))) {
+            return false;
+        }
+
+        data.resize(size);
+        if (size > 0 && !read_exact(reinterpret_cast<std::uint8_t *>(&data[0]), size)) {
+            return false;
+        }
+        for (std::size_t i = 0; i < size; i++) {
+            data[i] ^= mask[i % 4];
+        }
+        return true;
+    }
+
+    bool
+    read_exact(std::uint8_t *out, std::size_t size)
+    {
+        // data read by the http server together with the request
+        auto buffered = std::min(size, buffer.size());
+        std::copy(buffer.begin(), buffer.begin() + buffered, out);
+        buffer.erase(0, buffered);
+
+        for (std::size_t done = buffered; done < size; ) {
+            auto n = recv(socket, reinterpret_cast<char *>(out + done), size - done, 0);
+            if (n < 0 && interrupted()) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            done += n;
+        }
+        return true;
+    }
+
+    void
+    set_blocking()
+    {
+#ifdef _WIN32
+        u_long mode = 0;
+        ioctlsocket(socket, FIONBIO, &mode);
+#else
+        auto flags = fcntl(socket, F_GETFL);
+        if (flags >= 0 && (flags & O_NONBLOCK)) {
+            fcntl(socket, F_SETFL, flags & ~O_NONBLOCK);
+        }
+#endif
+    }
+
+    // a signal arrived before any data, the call is simply repeated
+    static
+    bool
+    interrupted()
+    {
+#ifdef _WIN32
+        return false;
+#else
+        return errno == EINTR;
+#endif
+    }
+
+    void
+    set_timeout(int seconds)
+    {
+#ifdef _WIN32
+        DWORD value = seconds * 1000;
+#else
+        timeval value = {seconds, 0};
+#endif
+        auto option = reinterpret_cast<char const *>(&value);
+        setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, option, sizeof(value));
+        setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, option, sizeof(value));
+    }
+
+#ifdef MSG_NOSIGNAL
+    static const int send_flags = MSG_NOSIGNAL; // no SIGPIPE on closed peers
+#else
+    static const int send_flags = 0;
+#endif
+
+    void
+    write_all(char const *data, std::size_t size)
+    {
+        for (std::size_t done = 0; done < size; ) {
+            auto n = ::send(socket, data + done, size - done, send_flags);
+            if (n < 0 && interrupted()) {
+                continue;
+            }
+            if (n <= 0) {
+                throw std::runtime_error{"websocket write failed"};
+            }
+            done += n;
+        }
+    }
+};
+
+}
+}
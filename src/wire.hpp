@@ -40,16 +40,33 @@ struct device_info
     std::uint16_t vendor_id;
     std::uint16_t product_id;
     std::string path;
+    std::string serial_number;
 
     bool
     operator==(device_info const &rhs) const
     {
         return (vendor_id == rhs.vendor_id)
             && (product_id == rhs.product_id)
-            && (path == rhs.path);
+            && (path == rhs.path)
+            && (serial_number == rhs.serial_number);
     }
 };
 
+// serial numbers of TREZOR devices are hex strings, anything outside
+// of ASCII is replaced
+std::string
+serial_number_of(hid_device_info const *info)
+{
+    std::string serial;
+    if (info->serial_number) {
+        for (auto c = info->serial_number; *c; c++) {
+            auto code = static_cast<std::uint32_t>(*c);
+            serial.push_back(code < 0x80 ? static_cast<char>(code) : '?');
+        }
+    }
+    return serial;
+}
+
 typedef std::vector<device_info> device_info_list;
 
 template <typename F>
@@ -83,7 +100,8 @@ enumerate_connected_devices(F filter)
             device_info{
                 i->vendor_id,
                 i->product_id,
-                i->path});
+                i->path,
+                serial_number_of(i)});
     }
 
     hid::free_enumeration(infos);
@@ -94,6 +112,7 @@ struct device
 {
     typedef std::uint8_t char_type;
     typedef std::size_t size_type;
+    typedef std::pair<char_type const *, size_type> chunk_type;
 
     struct open_error
         : public std::runtime_error
@@ -183,6 +202,36 @@ struct device
         }
     }
 
+    // write several chunks as one stream of reports, without joining
+    // them into a single buffer first
+    void
+    write(std::initializer_list<chunk_type> chunks)
+    {
+        std::array<char_type, report_payload_size> payload;
+        size_type filled = 0;
+
+        for (auto const &chunk: chunks) {
+            auto data = chunk.first;
+            auto len = chunk.second;
+
+            while (len > 0) {
+                size_type n = std::min(payload.size() - filled, len);
+                std::copy(data, data + n, payload.begin() + filled);
+                filled += n;
+                data += n;
+                len -= n;
+
+                if (filled == payload.size()) {
+                    write_report(payload.data(), filled);
+                    filled = 0;
+                }
+            }
+        }
+        if (filled > 0) {
+            write_report(payload.data(), filled);
+        }
+    }
+
 private:
 
     size_type
@@ -236,8 +285,8 @@ private:
         report_type report;
         report.fill(0x00);
 
-        size_type n = min(static_cast<size_type>(63), len);
-        size_type report_size = 63 + hid_version;
+        size_type n = min(report_payload_size, len);
+        size_type report_size = report_payload_size + hid_version;
 
         switch (hid_version) {
             case 1:
@@ -265,11 +314,15 @@ private:
     typedef std::vector<char_type> buffer_type;
     typedef std::array<char_type, 65> report_type;
 
+    static const size_type report_payload_size = 63;
+
     hid_device *hid;
     buffer_type read_buffer;
     int hid_version;
 };
 
+const device::size_type device::report_payload_size;
+
 struct message
 {
     std::uint16_t id;
@@ -294,16 +347,7 @@ struct message
         }
 
         device.read_buffered(buf, 6);
-
-        id = ntohs((buf[0] << 0) | (buf[1] << 8));
-        size = ntohl((buf[2] << 0) | (buf[3] << 8) |
-                     (buf[4] << 16) | (buf[5] << 24));
-
-        // 1MB of the message size treshold
-        static const std::uint32_t max_size = 1024 * 1024;
-        if (size > max_size) {
-            throw header_read_error{"message is too big"};
-        }
+        size = read_header(buf);
 
         data.resize(size);
         device.read_buffered(data.data(), data.size());
@@ -312,9 +356,47 @@ struct message
     void
     write_to(device &device) const
     {
-        std::size_t buf_size = 8 + data.size();
-        device::char_type buf[buf_size];
+        device::char_type header[header_size];
+
+        write_header(header, id, data.size());
+        device.write({{header, header_size},
+                      {data.data(), data.size()}});
+    }
+
+    // in-memory "##" framing, same as on the device wire
+
+    void
+    read_from_frame(device::char_type const *frame,
+                    std::size_t frame_size)
+    {
+        if (frame_size < header_size || frame[0] != '#' || frame[1] != '#') {
+            throw header_read_error{"header bytes are malformed"};
+        }
+
+        std::uint32_t size = read_header(frame + 2);
+        if (size != frame_size - header_size) {
+            throw header_read_error{"message size does not match"};
+        }
+
+        data.assign(frame + header_size, frame + frame_size);
+    }
 
+    void
+    write_to_frame(std::vector<device::char_type> &frame) const
+    {
+        frame.resize(header_size + data.size());
+        write_header(frame.data(), id, data.size());
+        std::copy(data.begin(), data.end(), &frame[header_size]);
+    }
+
+    static const std::size_t header_size = 8;
+
+    static
+    void
+    write_header(device::char_type *buf,
+                 std::uint16_t id,
+                 std::uint32_t size)
+    {
         buf[0] = '#';
         buf[1] = '#';
 
@@ -322,14 +404,73 @@ struct message
         buf[2] = (id_ >> 0) & 0xFF;
         buf[3] = (id_ >> 8) & 0xFF;
 
-        std::uint32_t size_ = htonl(data.size());
+        std::uint32_t size_ = htonl(size);
         buf[4] = (size_ >> 0) & 0xFF;
         buf[5] = (size_ >> 8) & 0xFF;
         buf[6] = (size_ >> 16) & 0xFF;
         buf[7] = (size_ >> 24) & 0xFF;
+    }
+
+private:
+
+    std::uint32_t
+    read_header(device::char_type const *buf)
+    {
+        id = ntohs((buf[0] << 0) | (buf[1] << 8));
+        std::uint32_t size = ntohl((buf[2] << 0) | (buf[3] << 8) |
+                                   (buf[4] << 16) | (buf[5] << 24));
+
+        // 1MB of the message size treshold
+        static const std::uint32_t max_size = 1024 * 1024;
+        if (size > max_size) {
+            throw header_read_error{"message is too big"};
+        }
+
+        return size;
+    }
+};
+
+const std::size_t message::header_size;
+
+// message consisting of a single length-delimited field number 1,
+// written straight from an external buffer, i.e. a memory-mapped
+// firmware image inside FirmwareUpload, without copying the payload
+struct bytes_message
+{
+    std::uint16_t id;
+    std::uint8_t const *bytes;
+    std::size_t bytes_size;
+
+    // field key and varint-encoded length come before the bytes, and the
+    // frame header has 32 bits for the size of it all
+    static const std::size_t max_prefix_size = 1 + 10;
+    static const std::size_t max_bytes_size = 0xFFFFFFFF - max_prefix_size;
+
+    void
+    write_to(device &device) const
+    {
+        if (bytes_size > max_bytes_size) {
+            throw std::invalid_argument{"message does not fit in a frame"};
+        }
+
+        device::char_type prefix[max_prefix_size];
+        std::size_t prefix_size = 0;
+
+        prefix[prefix_size++] = (1 << 3) | 2;
+        for (auto n = bytes_size; ; n >>= 7) {
+            if (n < 0x80) {
+                prefix[prefix_size++] = n;
+                break;
+            }
+            prefix[prefix_size++] = (n & 0x7F) | 0x80;
+        }
+
+        device::char_type header[message::header_size];
+        message::write_header(header, id, prefix_size + bytes_size);
 
-        std::copy(data.begin(), data.end(), &buf[8]);
-        device.write(buf, buf_size);
+        device.write({{header, message::header_size},
+                      {prefix, prefix_size},
+                      {bytes, bytes_size}});
     }
 };
 
@@ -0,0 +1,184 @@
+#include <easylogging++.h>
+
+#include "utils.hpp"
+#include "http_server.hpp"
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#define BOOST_TEST_MODULE HttpServer
+
+#include <boost/test/unit_test.hpp>
+
+_INITIALIZE_EASYLOGGINGPP
+
+using namespace trezord;
+
+struct router_fixture
+{
+    http_server::route_table table;
+    std::unique_ptr<http_server::router> router;
+    http_server::path_params params;
+
+    // handlers are told apart by their place in the table
+    void
+    build(std::vector<std::pair<char const *, char const *>> const &routes)
+    {
+        table.clear();
+        for (auto const &r: routes) {
+            table.emplace_back(http_server::route{r.first, r.second}, handler());
+        }
+        router.reset(new http_server::router{table});
+    }
+
+    // index of the matched route, -1 if nothing matched
+    int
+    match(char const *method, char const *url)
+    {
+        http_server::request_data request{};
+        request.method = method;
+        request.url = url;
+
+        auto matched = router->match(&request);
+        params = request.url_params;
+
+        for (std::size_t i = 0; i < table.size(); i++) {
+            if (&table[i].second == matched) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    static
+    http_server::request_handler
+    handler()
+    {
+        return [] (http_server::request_data const &) {
+            return http_server::response_data::deferred();
+        };
+    }
+};
+
+BOOST_FIXTURE_TEST_CASE(literal_before_parameter,
+                        router_fixture)
+{
+    build({
+        {"POST", "/acquire/:path"},
+        {"POST", "/acquire/:path/:previous"},
+        {"POST", "/acquire/serial/:serial"},
+        {"POST", "/acquire/serial/:serial/:previous"}
+    });
+
+    BOOST_CHECK_EQUAL(match("POST", "/acquire/abc"), 0);
+    BOOST_CHECK_EQUAL(params.get("path"), "abc");
+
+    BOOST_CHECK_EQUAL(match("POST", "/acquire/abc/def"), 1);
+    BOOST_CHECK_EQUAL(params.get("path"), "abc");
+    BOOST_CHECK_EQUAL(params.get("previous"), "def");
+
+    BOOST_CHECK_EQUAL(match("POST", "/acquire/serial/abc"), 2);
+    BOOST_CHECK_EQUAL(params.get("serial"), "abc");
+    BOOST_CHECK(!params.has("path"));
+
+    BOOST_CHECK_EQUAL(match("POST", "/acquire/serial/abc/def"), 3);
+    BOOST_CHECK_EQUAL(params.get("serial"), "abc");
+    BOOST_CHECK_EQUAL(params.get("previous"), "def");
+
+    // nothing follows the literal, so it is a path after all
+    BOOST_CHECK_EQUAL(match("POST", "/acquire/serial"), 0);
+    BOOST_CHECK_EQUAL(params.get("path"), "serial");
+}
+
+BOOST_FIXTURE_TEST_CASE(parameter_before_tail,
+                        router_fixture)
+{
+    build({
+        {"POST", "/call/*session"},
+        {"POST", "/call/:session/info"}
+    });
+
+    BOOST_CHECK_EQUAL(match("POST", "/call/abc/info"), 1);
+    BOOST_CHECK_EQUAL(params.get("session"), "abc");
+
+    BOOST_CHECK_EQUAL(match("POST", "/call/abc"), 0);
+    BOOST_CHECK_EQUAL(params.get("session"), "abc");
+
+    // the tail takes the rest of the path, slashes included
+    BOOST_CHECK_EQUAL(match("POST", "/call/abc/def"), 0);
+    BOOST_CHECK_EQUAL(params.get("session"), "abc/def");
+}
+
+BOOST_FIXTURE_TEST_CASE(dead_ends_backtrack,
+                        router_fixture)
+{
+    build({
+        {"GET", "/a/b/c"},
+        {"GET", "/a/:x/d"},
+        {"GET", "/a/*rest"}
+    });
+
+    BOOST_CHECK_EQUAL(match("GET", "/a/b/c"), 0);
+    BOOST_CHECK(params.values.empty());
+
+    BOOST_CHECK_EQUAL(match("GET", "/a/b/d"), 1);
+    BOOST_CHECK_EQUAL(params.get("x"), "b");
+
+    // parameters of an abandoned branch do not leak
+    BOOST_CHECK_EQUAL(match("GET", "/a/b/e"), 2);
+    BOOST_CHECK_EQUAL(params.values.size(), 1);
+    BOOST_CHECK_EQUAL(params.get("rest"), "b/e");
+}
+
+BOOST_FIXTURE_TEST_CASE(methods_and_fallbacks,
+                        router_fixture)
+{
+    build({
+        {"GET",  "/"},
+        {"GET",  "/listen"},
+        {"POST", "/listen"},
+        {"*",    "/any"},
+        {"POST", "*"},
+        {"*",    "*"}
+    });
+
+    BOOST_CHECK_EQUAL(match("GET", "/"), 0);
+    BOOST_CHECK_EQUAL(match("GET", "/listen"), 1);
+    BOOST_CHECK_EQUAL(match("POST", "/listen"), 2);
+    BOOST_CHECK_EQUAL(match("OPTIONS", "/any"), 3);
+
+    // a method fallback goes before the one for any method
+    BOOST_CHECK_EQUAL(match("POST", "/nothing"), 4);
+    BOOST_CHECK_EQUAL(match("GET", "/nothing"), 5);
+    BOOST_CHECK_EQUAL(match("PUT", "/listen"), 5);
+
+    // empty segments and trailing slashes match no route
+    BOOST_CHECK_EQUAL(match("GET", "/listen/"), 5);
+    BOOST_CHECK_EQUAL(match("GET", "//listen"), 5);
+    BOOST_CHECK_EQUAL(match("GET", ""), 5);
+}
+
+BOOST_FIXTURE_TEST_CASE(no_fallback_matches_nothing,
+                        router_fixture)
+{
+    build({
+        {"POST", "/call/*session"}
+    });
+
+    BOOST_CHECK_EQUAL(match("POST", "/call/"), -1);
+    BOOST_CHECK_EQUAL(match("GET", "/call/abc"), -1);
+}
+
+BOOST_FIXTURE_TEST_CASE(invalid_routes_are_rejected,
+                        router_fixture)
+{
+    BOOST_CHECK_THROW(build({{"GET", "listen"}}), std::invalid_argument);
+    BOOST_CHECK_THROW(build({{"GET", "/a//b"}}), std::invalid_argument);
+    BOOST_CHECK_THROW(build({{"GET", "/a/*rest/b"}}), std::invalid_argument);
+    BOOST_CHECK_THROW(build({{"GET", "/a/:x"}, {"GET", "/a/:y/b"}}),
+                      std::invalid_argument);
+    BOOST_CHECK_THROW(build({{"GET", "/a/:x"}, {"GET", "/a/:x"}}),
+                      std::invalid_argument);
+    BOOST_CHECK_THROW(build({{"*", "*"}, {"*", "*"}}), std::invalid_argument);
+}
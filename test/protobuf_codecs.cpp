@@ -1,11 +1,13 @@
 #include <easylogging++.h>
 
 #include "utils.hpp"
+#include "hid.hpp"
 #include "wire.hpp"
 
 #include "protobuf/state.hpp"
 #include "protobuf/json_codec.hpp"
 #include "protobuf/wire_codec.hpp"
+#include "protobuf/cbor_codec.hpp"
 
 #include "fixtures/messages.hpp"
 
@@ -43,21 +45,56 @@ struct loaded_state_fixture
         // initialize the protobuf state
         protobuf_state.load_from_set(descriptor_set);
     }
+
+    using convert_function = std::function<
+        protobuf::pb::Message *(protobuf::pb::Message const &)>;
+
+    // every sample has to survive a conversion to another encoding and
+    // back unchanged on the wire
+    void
+    check_round_trips(convert_function convert)
+    {
+        protobuf::wire_codec wire_codec(&protobuf_state);
+        wire_codec.load_protobuf_state();
+
+        for (auto &row: message_encoding_sample) {
+            std::uint16_t wire_id = row.first.first;
+            std::string wire_str = row.first.second;
+
+            wire::message wire_in{
+                wire_id, {wire_str.begin(), wire_str.end()}
+            };
+            std::unique_ptr<protobuf::pb::Message> pbuf_in(
+                wire_codec.wire_to_protobuf(wire_in));
+            std::unique_ptr<protobuf::pb::Message> pbuf_out(
+                convert(*pbuf_in));
+
+            wire::message wire_out;
+            wire_codec.protobuf_to_wire(*pbuf_out, wire_out);
+
+            BOOST_REQUIRE_EQUAL(wire_out.id, wire_in.id);
+            BOOST_CHECK_EQUAL_COLLECTIONS(
+                wire_out.data.begin(),
+                wire_out.data.end(),
+                wire_in.data.begin(),
+                wire_in.data.end());
+        }
+    }
 };
 
 BOOST_FIXTURE_TEST_CASE(wire_codec_with_empty_state_fails,
                         empty_state_fixture)
 {
     // fails because of missing MessageType enum
-    protobuf::wire_codec wc(protobuf_state);
+    protobuf::wire_codec wc(&protobuf_state);
     BOOST_CHECK_THROW(wc.load_protobuf_state(), std::invalid_argument);
 }
 
 BOOST_FIXTURE_TEST_CASE(json_to_wire_conversion,
                         loaded_state_fixture)
 {
-    protobuf::json_codec json_codec(protobuf_state);
-    protobuf::wire_codec wire_codec(protobuf_state);
+    protobuf::json_codec json_codec(&protobuf_state);
+    protobuf::wire_codec wire_codec(&protobuf_state);
 
     wire_codec.load_protobuf_state();
 
@@ -95,8 +132,8 @@ BOOST_FIXTURE_TEST_CASE(json_to_wire_conversion,
 BOOST_FIXTURE_TEST_CASE(wire_to_json_conversion,
                         loaded_state_fixture)
 {
-    protobuf::json_codec json_codec(protobuf_state);
-    protobuf::wire_codec wire_codec(protobuf_state);
+    protobuf::json_codec json_codec(&protobuf_state);
+    protobuf::wire_codec wire_codec(&protobuf_state);
 
     wire_codec.load_protobuf_state();
 
@@ -121,3 +158,181 @@ BOOST_FIXTURE_TEST_CASE(wire_to_json_conversion,
             expected_json.toStyledString());
     }
 }
+
+BOOST_FIXTURE_TEST_CASE(base64_bytes_round_trip,
+                        loaded_state_fixture)
+{
+    protobuf::json_codec json_codec(&protobuf_state);
+
+    check_round_trips([&] (protobuf::pb::Message const &pbuf) {
+            Json::Value json = json_codec.protobuf_to_typed_json(
+                pbuf, protobuf::bytes_encoding::base64);
+            return json_codec.typed_json_to_protobuf(
+                json, protobuf::bytes_encoding::base64);
+        });
+}
+
+BOOST_FIXTURE_TEST_CASE(cbor_round_trip,
+                        loaded_state_fixture)
+{
+    protobuf::cbor_codec cbor_codec(&protobuf_state);
+
+    check_round_trips([&] (protobuf::pb::Message const &pbuf) {
+            cbor::writer writer;
+            cbor_codec.protobuf_to_typed_cbor(pbuf, writer);
+
+            cbor::reader reader(writer.data.data(), writer.data.size());
+            auto pbuf_out = cbor_codec.typed_cbor_to_protobuf(reader);
+            BOOST_CHECK(reader.at_end());
+            return pbuf_out;
+        });
+}
+
+BOOST_FIXTURE_TEST_CASE(bytes_field_encodings,
+                        loaded_state_fixture)
+{
+    protobuf::json_codec json_codec(&protobuf_state);
+    protobuf::cbor_codec cbor_codec(&protobuf_state);
+
+    Json::Value json;
+    Json::Reader reader;
+    reader.parse(R"({"type": "Entropy", "message": {"entropy": "0102fbff"}})", json);
+
+    std::unique_ptr<protobuf::pb::Message> pbuf(
+        json_codec.typed_json_to_protobuf(json, protobuf::bytes_encoding::hex));
+
+    // base64 uses the standard alphabet with padding
+    auto base64 = json_codec.protobuf_to_typed_json(
+        *pbuf, protobuf::bytes_encoding::base64);
+    BOOST_CHECK_EQUAL(base64["message"]["entropy"].asString(), "AQL7/w==");
+
+    // bytes are a CBOR byte string, major type 2
+    cbor::writer writer;
+    cbor_codec.protobuf_to_typed_cbor(*pbuf, writer);
+    BOOST_CHECK_EQUAL(utils::hex_encode(std::string(writer.data.begin(),
+                                                    writer.data.end())),
+                      "a2"                  // {
+                      "6474797065"          // "type":
+                      "67456e74726f7079"    // "Entropy",
+                      "676d657373616765"    // "message":
+                      "a1"                  // {
+                      "67656e74726f7079"    // "entropy":
+                      "440102fbff");        // h'0102fbff'}}
+}
+
+BOOST_AUTO_TEST_CASE(cbor_json_conversion)
+{
+    Json::Value json;
+    Json::Reader reader;
+    reader.parse("{\"a\": [1, -1000, 1.5, true, null], \"b\": \"text\"}", json);
+
+    auto cbor_str = cbor::json_to_cbor_string(json);
+    BOOST_CHECK_EQUAL(utils::hex_encode(cbor_str),
+                      "a26161"              // {"a":
+                      "85"                  // [
+                      "01"                  // 1,
+                      "3903e7"              // -1000,
+                      "fb3ff8000000000000"  // 1.5,
+                      "f5f6"                // true, null],
+                      "6162"                // "b":
+                      "6474657874");        // "text"}
+
+    BOOST_CHECK_EQUAL(cbor::cbor_string_to_json(cbor_str).toStyledString(),
+                      json.toStyledString());
+}
+
+BOOST_FIXTURE_TEST_CASE(cbor_integer_ranges,
+                        loaded_state_fixture)
+{
+    protobuf::cbor_codec cbor_codec(&protobuf_state);
+
+    // {"type": type, "message": {field: value}}, value written by write
+    auto decode = [&] (char const *type, char const *field,
+                       std::function<void (cbor::writer &)> write) {
+        cbor::writer writer;
+        writer.write_map_header(2);
+        writer.write_text("type");
+        writer.write_text(type);
+        writer.write_text("message");
+        writer.write_map_header(1);
+        writer.write_text(field);
+        write(writer);
+
+        cbor::reader reader(writer.data.data(), writer.data.size());
+        std::unique_ptr<protobuf::pb::Message> pbuf(
+            cbor_codec.typed_cbor_to_protobuf(reader));
+    };
+
+    // uint32 ResetDevice.strength
+    BOOST_CHECK_NO_THROW(decode("ResetDevice", "strength", [] (cbor::writer &w) {
+                w.write_uint(0xFFFFFFFF);
+            }));
+    BOOST_CHECK_THROW(decode("ResetDevice", "strength", [] (cbor::writer &w) {
+                w.write_uint(0x100000000);
+            }), std::invalid_argument);
+
+    // repeated uint32 GetAddress.address_n
+    BOOST_CHECK_THROW(decode("GetAddress", "address_n", [] (cbor::writer &w) {
+                w.write_array_header(2);
+                w.write_uint(44);
+                w.write_uint(0x100000000);
+            }), std::invalid_argument);
+
+    // values over the int64 range cannot be read as signed
+    std::string too_big{"\x3b\xff\xff\xff\xff\xff\xff\xff\xff", 9};
+    cbor::reader reader(reinterpret_cast<std::uint8_t const *>(too_big.data()),
+                        too_big.size());
+    BOOST_CHECK_THROW(reader.read_int(), std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_CASE(cbor_nesting_limit)
+{
+    // arrays of one item nested around a zero
+    auto nested = [] (int depth) {
+        return std::string(depth, '\x81') + std::string(1, '\x00');
+    };
+
+    auto allowed = nested(cbor::max_depth);
+    BOOST_CHECK_NO_THROW(cbor::cbor_string_to_json(allowed));
+
+    auto too_deep = nested(cbor::max_depth + 1);
+    BOOST_CHECK_THROW(cbor::cbor_string_to_json(too_deep),
+                      std::invalid_argument);
+
+    // nothing near the stack size is ever read
+    auto huge = nested(1000000);
+    BOOST_CHECK_THROW(cbor::cbor_string_to_json(huge),
+                      std::invalid_argument);
+
+    cbor::reader reader(reinterpret_cast<std::uint8_t const *>(too_deep.data()),
+                        too_deep.size());
+    BOOST_CHECK_THROW(reader.skip(), std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_CASE(wire_frame_round_trip)
+{
+    for (auto &row: message_encoding_sample) {
+        std::uint16_t wire_id = row.first.first;
+        std::string wire_str = row.first.second;
+
+        wire::message wire_in{
+            wire_id, {wire_str.begin(), wire_str.end()}
+        };
+        std::vector<std::uint8_t> frame;
+        wire_in.write_to_frame(frame);
+
+        wire::message wire_out;
+        wire_out.read_from_frame(frame.data(), frame.size());
+
+        BOOST_REQUIRE_EQUAL(wire_out.id, wire_in.id);
+        BOOST_CHECK_EQUAL_COLLECTIONS(
+            wire_out.data.begin(),
+            wire_out.data.end(),
+            wire_in.data.begin(),
+            wire_in.data.end());
+
+        frame.pop_back();
+        BOOST_CHECK_THROW(wire_out.read_from_frame(frame.data(), frame.size()),
+                          wire::message::header_read_error);
+    }
+}
@@ -0,0 +1,161 @@
+#include <easylogging++.h>
+
+#include "utils.hpp"
+#include "hid.hpp"
+#include "wire.hpp"
+#include "core.hpp"
+
+#include <google/protobuf/text_format.h>
+
+#include <string>
+
+#define BOOST_TEST_MODULE ResponseCache
+
+#include <boost/test/unit_test.hpp>
+
+_INITIALIZE_EASYLOGGINGPP
+
+using namespace trezord;
+
+// the fixture protocol predates show_display, this one is just enough
+// of a newer one
+static const char *protocol = R"(
+    file {
+        name: "messages.proto"
+        enum_type {
+            name: "MessageType"
+            value { name: "MessageType_Initialize" number: 0 }
+            value { name: "MessageType_Failure" number: 3 }
+            value { name: "MessageType_Features" number: 17 }
+            value { name: "MessageType_ButtonRequest" number: 26 }
+            value { name: "MessageType_GetAddress" number: 29 }
+            value { name: "MessageType_Address" number: 30 }
+            value { name: "MessageType_GetFeatures" number: 55 }
+        }
+        message_type { name: "Initialize" }
+        message_type { name: "Failure" }
+        message_type {
+            name: "Features"
+            field { name: "label" number: 1 label: LABEL_OPTIONAL type: TYPE_STRING }
+        }
+        message_type { name: "ButtonRequest" }
+        message_type {
+            name: "GetAddress"
+            field { name: "address_n" number: 1 label: LABEL_REPEATED type: TYPE_UINT32 }
+            field { name: "show_display" number: 2 label: LABEL_OPTIONAL type: TYPE_BOOL }
+        }
+        message_type {
+            name: "Address"
+            field { name: "address" number: 1 label: LABEL_REQUIRED type: TYPE_STRING }
+        }
+        message_type { name: "GetFeatures" }
+    }
+)";
+
+struct cache_fixture
+{
+    std::shared_ptr<core::kernel_schema> schema;
+    core::response_cache::policy_ptr policy;
+    core::response_cache cache;
+
+    cache_fixture()
+    {
+        protobuf::pb::FileDescriptorSet descriptor_set;
+        BOOST_REQUIRE(google::protobuf::TextFormat::ParseFromString(
+                          protocol, &descriptor_set));
+        schema = std::make_shared<core::kernel_schema>(descriptor_set);
+        policy = core::kernel::make_cache_policy(schema, {"GetFeatures", "GetAddress"});
+    }
+
+    wire::message
+    message(std::string const &str)
+    {
+        Json::Value json;
+        Json::Reader reader;
+        BOOST_REQUIRE(reader.parse(str, json));
+
+        wire::message wire;
+        schema->json_to_wire(json, wire, protobuf::bytes_encoding::hex);
+        return wire;
+    }
+
+    // a call of request answered by response, as the device kernel does it
+    void
+    call(wire::message const &request, wire::message const &response)
+    {
+        if (cache.admit(request, policy)) {
+            cache.store(request, response);
+        }
+    }
+};
+
+BOOST_FIXTURE_TEST_CASE(cached_response_is_found,
+                        cache_fixture)
+{
+    auto get_features = message(R"({"type": "GetFeatures", "message": {}})");
+    auto features = message(R"({"type": "Features", "message": {"label": "x"}})");
+    call(get_features, features);
+
+    wire::message cached;
+    BOOST_REQUIRE(cache.admit(get_features, policy));
+    BOOST_REQUIRE(cache.find(get_features, cached));
+    BOOST_CHECK_EQUAL(cached.id, features.id);
+    BOOST_CHECK(cached.data == features.data);
+
+    // same type, different data
+    auto get_address = message(R"({"type": "GetAddress", "message": {"address_n": [1]}})");
+    BOOST_REQUIRE(cache.admit(get_address, policy));
+    BOOST_CHECK(!cache.find(get_address, cached));
+}
+
+BOOST_FIXTURE_TEST_CASE(other_call_drops_responses,
+                        cache_fixture)
+{
+    call(message(R"({"type": "GetFeatures", "message": {}})"),
+         message(R"({"type": "Features", "message": {}})"));
+    BOOST_CHECK_EQUAL(cache.size(), 1);
+
+    // Initialize is not in the allowlist, it might change the device
+    BOOST_CHECK(!cache.admit(message(R"({"type": "Initialize", "message": {}})"), policy));
+    BOOST_CHECK_EQUAL(cache.size(), 0);
+}
+
+BOOST_FIXTURE_TEST_CASE(show_display_is_not_cached,
+                        cache_fixture)
+{
+    auto quiet = message(R"({"type": "GetAddress", "message": {"address_n": [1]}})");
+    auto shown = message(R"({"type": "GetAddress", "message": {"address_n": [1], "show_display": true}})");
+    auto address = message(R"({"type": "Address", "message": {"address": "1x"}})");
+
+    call(quiet, address);
+    BOOST_CHECK_EQUAL(cache.size(), 1);
+
+    // the user has to see it on the device every time
+    BOOST_CHECK(!cache.admit(shown, policy));
+    BOOST_CHECK_EQUAL(cache.size(), 0);
+}
+
+BOOST_FIXTURE_TEST_CASE(interaction_is_not_cached,
+                        cache_fixture)
+{
+    auto get_address = message(R"({"type": "GetAddress", "message": {"address_n": [1]}})");
+
+    call(get_address, message(R"({"type": "ButtonRequest", "message": {}})"));
+    call(get_address, message(R"({"type": "Failure", "message": {}})"));
+    BOOST_CHECK_EQUAL(cache.size(), 0);
+}
+
+BOOST_FIXTURE_TEST_CASE(reconfiguring_drops_responses,
+                        cache_fixture)
+{
+    auto get_features = message(R"({"type": "GetFeatures", "message": {}})");
+    call(get_features, message(R"({"type": "Features", "message": {}})"));
+
+    auto other_policy = core::kernel::make_cache_policy(schema, {"GetFeatures"});
+    BOOST_CHECK(cache.admit(get_features, other_policy));
+    BOOST_CHECK_EQUAL(cache.size(), 0);
+
+    // no policy caches nothing
+    BOOST_CHECK(!core::kernel::make_cache_policy(schema, {}));
+    BOOST_CHECK(!cache.admit(get_features, nullptr));
+}
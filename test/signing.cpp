@@ -0,0 +1,157 @@
+#include <easylogging++.h>
+
+#include "utils.hpp"
+#include "hid.hpp"
+#include "wire.hpp"
+#include "core.hpp"
+#include "signing.hpp"
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#define BOOST_TEST_MODULE Signing
+
+#include <boost/test/unit_test.hpp>
+
+_INITIALIZE_EASYLOGGINGPP
+
+using namespace trezord;
+
+struct schema_fixture
+{
+    std::unique_ptr<core::kernel_schema> schema;
+
+    schema_fixture()
+    {
+        std::ifstream config("../test/fixtures/trezor.bin",
+                             std::ios::in | std::ios::binary);
+        BOOST_REQUIRE(config.good());
+
+        protobuf::pb::FileDescriptorSet descriptor_set;
+        descriptor_set.ParseFromIstream(&config);
+        schema.reset(new core::kernel_schema{descriptor_set});
+    }
+
+    Json::Value
+    parse(std::string const &str)
+    {
+        Json::Value json;
+        Json::Reader reader;
+        BOOST_REQUIRE(reader.parse(str, json));
+        return json;
+    }
+
+    // feeds one device message to the driver, returns the answer, or
+    // null when the driver ends the flow
+    Json::Value
+    reply(signing::tx_driver &driver, std::string const &device_message)
+    {
+        wire::message wire_out;
+        wire::message wire_reply;
+        schema->json_to_wire(parse(device_message), wire_out,
+                             protobuf::bytes_encoding::hex);
+
+        Json::Value answer;
+        if (driver.reply(wire_out, wire_reply)) {
+            schema->wire_to_json(wire_reply, answer,
+                                 protobuf::bytes_encoding::hex);
+        }
+        return answer;
+    }
+};
+
+static const char *transaction = R"({
+    "message": {"type": "SignTx", "message": {"inputs_count": 1, "outputs_count": 1}},
+    "inputs": [{"address_n": [44], "prev_hash": "aa", "prev_index": 0}],
+    "outputs": [{"address": "1x", "amount": 5, "script_type": "PAYTOADDRESS"}],
+    "transactions": {
+        "aa": {
+            "version": 1,
+            "lock_time": 0,
+            "inputs": [{"prev_hash": "bb", "prev_index": 1, "script_sig": "00"}],
+            "bin_outputs": [{"amount": 7, "script_pubkey": "76a9"}]
+        }
+    }
+})";
+
+BOOST_FIXTURE_TEST_CASE(scripted_sign_tx,
+                        schema_fixture)
+{
+    signing::tx_driver driver{*schema, parse(transaction), protobuf::bytes_encoding::hex};
+
+    auto answer = reply(driver, R"({"type": "TxRequest", "message": {
+        "request_type": "TXINPUT", "details": {"request_index": 0}}})");
+    BOOST_CHECK_EQUAL(answer["type"].asString(), "TxAck");
+    BOOST_CHECK_EQUAL(answer["message"]["tx"]["inputs"][0]["prev_hash"].asString(), "aa");
+
+    answer = reply(driver, R"({"type": "TxRequest", "message": {
+        "request_type": "TXMETA", "details": {"tx_hash": "aa"}}})");
+    auto const &meta = answer["message"]["tx"];
+    BOOST_CHECK_EQUAL(meta["version"].asUInt(), 1);
+    BOOST_CHECK_EQUAL(meta["inputs_cnt"].asUInt(), 1);
+    BOOST_CHECK_EQUAL(meta["outputs_cnt"].asUInt(), 1);
+    BOOST_CHECK(!meta.isMember("inputs"));
+
+    answer = reply(driver, R"({"type": "TxRequest", "message": {
+        "request_type": "TXOUTPUT", "details": {"request_index": 0, "tx_hash": "aa"}}})");
+    BOOST_CHECK_EQUAL(answer["message"]["tx"]["bin_outputs"][0]["amount"].asUInt(), 7);
+
+    answer = reply(driver, R"({"type": "ButtonRequest", "message": {}})");
+    BOOST_CHECK_EQUAL(answer["type"].asString(), "ButtonAck");
+
+    answer = reply(driver, R"({"type": "TxRequest", "message": {
+        "request_type": "TXOUTPUT", "details": {"request_index": 0},
+        "serialized": {"serialized_tx": "0102"}}})");
+    BOOST_CHECK_EQUAL(answer["message"]["tx"]["outputs"][0]["address"].asString(), "1x");
+
+    answer = reply(driver, R"({"type": "TxRequest", "message": {
+        "request_type": "TXFINISHED",
+        "serialized": {"signature_index": 0, "signature": "3044", "serialized_tx": "03"}}})");
+    BOOST_CHECK(answer.isNull());
+
+    BOOST_CHECK(driver.is_finished());
+    BOOST_CHECK(!driver.is_failed());
+
+    auto result = driver.result();
+    BOOST_CHECK_EQUAL(result["signatures"][0].asString(), "3044");
+    BOOST_CHECK_EQUAL(result["serializedTx"].asString(), "010203");
+}
+
+BOOST_FIXTURE_TEST_CASE(unanswerable_request_cancels,
+                        schema_fixture)
+{
+    signing::tx_driver driver{*schema, parse(transaction), protobuf::bytes_encoding::hex};
+
+    // there is no second input
+    auto answer = reply(driver, R"({"type": "TxRequest", "message": {
+        "request_type": "TXINPUT", "details": {"request_index": 1}}})");
+    BOOST_CHECK_EQUAL(answer["type"].asString(), "Cancel");
+    BOOST_CHECK(driver.is_failed());
+    BOOST_CHECK(!driver.failure_reason().empty());
+
+    // the device confirms the cancel, which ends the flow
+    answer = reply(driver, R"({"type": "Failure", "message": {"message": "Cancelled"}})");
+    BOOST_CHECK(answer.isNull());
+    BOOST_CHECK(!driver.is_finished());
+}
+
+BOOST_FIXTURE_TEST_CASE(unknown_previous_transaction_cancels,
+                        schema_fixture)
+{
+    signing::tx_driver driver{*schema, parse(transaction), protobuf::bytes_encoding::hex};
+
+    auto answer = reply(driver, R"({"type": "TxRequest", "message": {
+        "request_type": "TXMETA", "details": {"tx_hash": "cc"}}})");
+    BOOST_CHECK_EQUAL(answer["type"].asString(), "Cancel");
+    BOOST_CHECK(driver.is_failed());
+}
+
+BOOST_FIXTURE_TEST_CASE(malformed_transaction_is_rejected,
+                        schema_fixture)
+{
+    BOOST_CHECK_THROW(
+        signing::tx_driver(*schema, parse(R"({"inputs": {}})"),
+                           protobuf::bytes_encoding::hex),
+        signing::tx_driver::invalid_transaction);
+}
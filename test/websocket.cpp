@@ -0,0 +1,193 @@
+#include <easylogging++.h>
+
+#include "websocket.hpp"
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <string>
+
+#include <boost/thread.hpp>
+
+#define BOOST_TEST_MODULE WebSocket
+
+#include <boost/test/unit_test.hpp>
+
+_INITIALIZE_EASYLOGGINGPP
+
+using namespace trezord;
+
+// connection on one end of a socket pair, the test plays the client on
+// the other end
+struct socket_pair_fixture
+{
+    int sockets[2];
+
+    socket_pair_fixture()
+    {
+        BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+    }
+
+    ~socket_pair_fixture()
+    {
+        close(sockets[0]);
+        close(sockets[1]);
+    }
+
+    // a client frame, masked unless told otherwise
+    static
+    std::string
+    client_frame(std::uint8_t head, std::string const &payload, bool masked = true)
+    {
+        static const std::uint8_t mask[4] = {0x12, 0x34, 0x56, 0x78};
+
+        std::string frame;
+        frame.push_back(static_cast<char>(head));
+
+        auto size = payload.size();
+        std::uint8_t mask_bit = masked ? 0x80 : 0x00;
+        if (size < 126) {
+            frame.push_back(static_cast<char>(mask_bit | size));
+        }
+        else {
+            frame.push_back(static_cast<char>(mask_bit | 126));
+            frame.push_back(static_cast<char>(size >> 8));
+            frame.push_back(static_cast<char>(size & 0xFF));
+        }
+
+        if (masked) {
+            frame.append(reinterpret_cast<char const *>(mask), sizeof(mask));
+        }
+        for (std::size_t i = 0; i < size; i++) {
+            frame.push_back(masked ? payload[i] ^ mask[i % 4] : payload[i]);
+        }
+        return frame;
+    }
+
+    void
+    client_send(std::string const &data)
+    {
+        BOOST_REQUIRE(write(sockets[1], data.data(), data.size())
+                      == static_cast<ssize_t>(data.size()));
+    }
+
+    std::string
+    client_receive()
+    {
+        char data[256];
+        auto n = read(sockets[1], data, sizeof(data));
+        BOOST_REQUIRE(n > 0);
+        return std::string(data, n);
+    }
+};
+
+BOOST_AUTO_TEST_CASE(accept_key_of_rfc_sample)
+{
+    // RFC 6455, section 1.3
+    BOOST_CHECK_EQUAL(websocket::accept_key("dGhlIHNhbXBsZSBub25jZQ=="),
+                      "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=");
+}
+
+BOOST_FIXTURE_TEST_CASE(masked_text_message,
+                        socket_pair_fixture)
+{
+    websocket::connection channel{sockets[0], "", 1024};
+    client_send(client_frame(0x81, "hello"));
+
+    websocket::opcode type;
+    std::string payload;
+    BOOST_REQUIRE(channel.read_message(type, payload));
+    BOOST_CHECK(type == websocket::opcode::text);
+    BOOST_CHECK_EQUAL(payload, "hello");
+}
+
+BOOST_FIXTURE_TEST_CASE(non_blocking_socket_waits_for_data,
+                        socket_pair_fixture)
+{
+    // the http server hands over its sockets in non-blocking mode
+    fcntl(sockets[0], F_SETFL, fcntl(sockets[0], F_GETFL) | O_NONBLOCK);
+    websocket::connection channel{sockets[0], "", 1024, 5};
+
+    boost::thread client{[this] {
+            boost::this_thread::sleep_for(boost::chrono::milliseconds(100));
+            client_send(client_frame(0x81, "late"));
+        }};
+
+    websocket::opcode type;
+    std::string payload;
+    BOOST_CHECK(channel.read_message(type, payload));
+    BOOST_CHECK_EQUAL(payload, "late");
+    client.join();
+}
+
+BOOST_FIXTURE_TEST_CASE(buffered_and_fragmented_message,
+                        socket_pair_fixture)
+{
+    // the first fragment was read together with the upgrade request
+    std::string long_part(300, 'x');
+    websocket::connection channel{sockets[0], client_frame(0x02, "ab"), 1024};
+    client_send(client_frame(0x00, long_part));
+    client_send(client_frame(0x80, "cd"));
+
+    websocket::opcode type;
+    std::string payload;
+    BOOST_REQUIRE(channel.read_message(type, payload));
+    BOOST_CHECK(type == websocket::opcode::binary);
+    BOOST_CHECK_EQUAL(payload, "ab" + long_part + "cd");
+}
+
+BOOST_FIXTURE_TEST_CASE(ping_is_answered,
+                        socket_pair_fixture)
+{
+    websocket::connection channel{sockets[0], "", 1024};
+    client_send(client_frame(0x89, "p"));
+    client_send(client_frame(0x81, "m"));
+
+    websocket::opcode type;
+    std::string payload;
+    BOOST_REQUIRE(channel.read_message(type, payload));
+    BOOST_CHECK_EQUAL(payload, "m");
+    BOOST_CHECK_EQUAL(client_receive(), std::string("\x8a\x01p", 3));
+}
+
+BOOST_FIXTURE_TEST_CASE(close_ends_the_connection,
+                        socket_pair_fixture)
+{
+    websocket::connection channel{sockets[0], "", 1024};
+    client_send(client_frame(0x88, std::string("\x03\xe8", 2)));
+
+    websocket::opcode type;
+    std::string payload;
+    BOOST_CHECK(!channel.read_message(type, payload));
+    BOOST_CHECK_EQUAL(client_receive(), std::string("\x88\x02\x03\xe8", 4));
+}
+
+BOOST_FIXTURE_TEST_CASE(invalid_frames_are_rejected,
+                        socket_pair_fixture)
+{
+    websocket::opcode type;
+    std::string payload;
+
+    websocket::connection unmasked{sockets[0], client_frame(0x81, "a", false), 1024};
+    BOOST_CHECK_THROW(unmasked.read_message(type, payload),
+                      websocket::connection::protocol_error);
+
+    websocket::connection too_large{sockets[0], client_frame(0x81, "abcdef"), 4};
+    BOOST_CHECK_THROW(too_large.read_message(type, payload),
+                      websocket::connection::protocol_error);
+
+    websocket::connection continuation{sockets[0], client_frame(0x80, "a"), 1024};
+    BOOST_CHECK_THROW(continuation.read_message(type, payload),
+                      websocket::connection::protocol_error);
+}
+
+BOOST_FIXTURE_TEST_CASE(idle_connection_times_out,
+                        socket_pair_fixture)
+{
+    websocket::connection channel{sockets[0], "", 1024, 1};
+
+    websocket::opcode type;
+    std::string payload;
+    BOOST_CHECK(!channel.read_message(type, payload));
+}